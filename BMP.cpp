@@ -1,8 +1,18 @@
 #include "BMP.hpp"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
 #include <cstring>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 // bmp uses little endian encoding!
 
@@ -32,14 +42,13 @@ struct BMPInfo
 
 static_assert(sizeof(BMPInfo) == 40);
 
-struct Pixel24
-{
-    uint8_t b, g, r;
-};
+static const uint16_t MAGIC = 19778; // ascii "BM"
 
-static_assert(sizeof(Pixel24) == 3);
+// the 8 bit files have a color table of the 256 gray levels
+static const uint32_t GRAY_COLORS = 256;
 
-static const uint16_t MAGIC = 19778; // ascii "BM"
+static const size_t MAX_HEADER_SIZE =
+  sizeof(MAGIC) + sizeof(BMPHeader) + sizeof(BMPInfo) + 4 * GRAY_COLORS;
 
 static const unsigned BUF_SIZE = 16 * 1024;
 
@@ -84,39 +93,84 @@ DEF_ENCODE_LE_SPEC(u32, uint32_t)
 DEF_ENCODE_LE_SPEC(i32, int32_t)
 
 static void
-convert_pixels(const RGBA *src, Pixel24 *dst, uint32_t size)
+gray_to_bgr_scalar(const uint8_t *src, uint8_t *dst, uint32_t n)
 {
-    bool is_le = is_little_endian();
-    for (unsigned i = 0; i < size; ++i) {
-        RGBA p = src[i];
-        if (is_le) {
-            dst[i].b = p.b;
-            dst[i].g = p.g;
-            dst[i].r = p.r;
-        } else {
-            dst[i].r = p.b;
-            dst[i].g = p.g;
-            dst[i].b = p.r;
-        }
+    for (uint32_t i = 0; i < n; ++i)
+        dst[3 * i] = dst[3 * i + 1] = dst[3 * i + 2] = src[i];
+}
+
+// 16 pixels per iteration, each of the 3 stores is shuffled from the same
+// 16 luminances
+static void __attribute__((target("ssse3")))
+gray_to_bgr_ssse3(const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+    const __m128i bgr0 =
+      _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+    const __m128i bgr1 =
+      _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+    const __m128i bgr2 = _mm_setr_epi8(
+      10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        auto out = reinterpret_cast<__m128i *>(dst + 3 * i);
+        _mm_storeu_si128(out, _mm_shuffle_epi8(v, bgr0));
+        _mm_storeu_si128(out + 1, _mm_shuffle_epi8(v, bgr1));
+        _mm_storeu_si128(out + 2, _mm_shuffle_epi8(v, bgr2));
     }
+
+    gray_to_bgr_scalar(src + i, dst + 3 * i, n - i);
 }
 
-bool
-write_bmp(FILE *out, uint32_t w, uint32_t h, const RGBA *pixels)
+void
+gray_to_bgr(const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+    static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+    if (has_ssse3)
+        gray_to_bgr_ssse3(src, dst, n);
+    else
+        gray_to_bgr_scalar(src, dst, n);
+}
+
+// every row is padded to a multiple of 4 bytes
+static uint32_t
+row_byte_size(uint32_t w, uint32_t bpp)
 {
+    return CEIL_DIV(w * (bpp / 8), 4) * 4;
+}
+
+static size_t
+header_size(uint32_t bpp)
+{
+    return bpp == 8 ? MAX_HEADER_SIZE : MAX_HEADER_SIZE - 4 * GRAY_COLORS;
+}
+
+size_t
+bmp_file_size(uint32_t w, uint32_t h, uint32_t bpp)
+{
+    return header_size(bpp) + size_t(row_byte_size(w, bpp)) * h;
+}
+
+// encodes the header of a bmp file into out, which has room for
+// MAX_HEADER_SIZE bytes, and returns its size
+static size_t
+encode_header(uint8_t *out, uint32_t w, uint32_t h, uint32_t bpp)
+{
+    const size_t meta_data_size = header_size(bpp);
+    const uint32_t payload_size = row_byte_size(w, bpp) * h;
+
     auto magic = encodeLE(MAGIC);
-    if (fwrite(&magic, sizeof magic, 1, out) != 1)
-        return false;
+    memcpy(out, &magic, sizeof magic);
+    out += sizeof magic;
 
     BMPHeader header;
-    const auto meta_data_size =
-      sizeof(MAGIC) + sizeof(BMPHeader) + sizeof(BMPInfo);
     memset(&header, 0, sizeof header);
-    header.byte_size = meta_data_size + w * h * sizeof(Pixel24);
-    header.payload_byte_offset = encodeLEu32(meta_data_size);
-
-    if (fwrite(&header, sizeof header, 1, out) != 1)
-        return false;
+    header.byte_size = encodeLEu32(uint32_t(meta_data_size + payload_size));
+    header.payload_byte_offset = encodeLEu32(uint32_t(meta_data_size));
+    memcpy(out, &header, sizeof header);
+    out += sizeof header;
 
     BMPInfo info;
     memset(&info, 0, sizeof info);
@@ -124,26 +178,133 @@ write_bmp(FILE *out, uint32_t w, uint32_t h, const RGBA *pixels)
     info.pixel_width = encodeLEi32(w);
     info.pixel_height = encodeLEi32(h);
     info.planes = encodeLEu16(1);
-    info.bbp = encodeLEu16(24);
+    info.bbp = encodeLEu16(uint16_t(bpp));
+    info.payload_byte_size = encodeLEu32(payload_size);
+    if (bpp == 8)
+        info.color_table_size = encodeLEu32(GRAY_COLORS);
+    memcpy(out, &info, sizeof info);
+    out += sizeof info;
+
+    if (bpp == 8) {
+        // blue, green, red and a reserved byte
+        for (uint32_t i = 0; i < GRAY_COLORS; ++i) {
+            out[4 * i] = out[4 * i + 1] = out[4 * i + 2] = uint8_t(i);
+            out[4 * i + 3] = 0;
+        }
+    }
+
+    return meta_data_size;
+}
 
-    if (fwrite(&info, sizeof info, 1, out) != 1)
+bool
+write_bmp(FILE *out,
+          uint32_t w,
+          uint32_t h,
+          uint32_t stride,
+          const uint8_t *pixels)
+{
+    uint8_t header[MAX_HEADER_SIZE];
+    size_t header_size = encode_header(header, w, h, 24);
+    if (fwrite(header, header_size, 1, out) != 1)
         return false;
 
-    Pixel24 pixel_buf[BUF_SIZE];
-    unsigned i;
-    for (i = 0; i < w * h / BUF_SIZE; ++i) {
-        convert_pixels(pixels + i * BUF_SIZE, pixel_buf, BUF_SIZE);
-        if (fwrite(pixel_buf, sizeof pixel_buf, 1, out) != 1)
+    const uint32_t row_size = w * 3;
+    const uint32_t row_padding = row_byte_size(w, 24) - row_size;
+
+    static const uint8_t zeros[4] = {};
+    uint8_t pixel_buf[BUF_SIZE * 3];
+    for (uint32_t y = 0; y < h; ++y) {
+        const uint8_t *row = pixels + size_t(y) * stride;
+        for (uint32_t x = 0; x < w; x += BUF_SIZE) {
+            uint32_t n = w - x < BUF_SIZE ? w - x : BUF_SIZE;
+            gray_to_bgr(row + x, pixel_buf, n);
+            if (fwrite(pixel_buf, n * 3, 1, out) != 1)
+                return false;
+        }
+        if (row_padding > 0 && fwrite(zeros, row_padding, 1, out) != 1)
             return false;
     }
 
-    unsigned offset = i * BUF_SIZE;
-    unsigned rem_size = w * h - offset;
-    if (rem_size > 0) {
-        convert_pixels(pixels + offset, pixel_buf, rem_size);
-        if (fwrite(pixel_buf, rem_size * sizeof *pixel_buf, 1, out) != 1)
+    return true;
+}
+
+// writes all of iov, continuing after partial writes
+static bool
+writev_all(int fd, iovec *iov, size_t n)
+{
+    while (n > 0) {
+        ssize_t written = writev(fd, iov, int(std::min(n, size_t(IOV_MAX))));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
             return false;
-    }
+        }
 
+        size_t left = size_t(written);
+        while (n > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
     return true;
 }
+
+bool
+write_bmp_file(const char *path,
+               uint32_t w,
+               uint32_t h,
+               uint32_t stride,
+               const uint8_t *pixels,
+               uint32_t bpp)
+{
+    dbg_assert(bpp == 24 || bpp == 8);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return false;
+
+    bool ok;
+    if (bpp == 24) {
+        // reused by the next frame written on this thread
+        static thread_local std::vector<uint8_t> file;
+        file.resize(bmp_file_size(w, h, 24));
+
+        uint8_t *out = file.data() + encode_header(file.data(), w, h, 24);
+        const uint32_t row_size = row_byte_size(w, 24);
+        for (uint32_t y = 0; y < h; ++y) {
+            gray_to_bgr(pixels + size_t(y) * stride, out, w);
+            memset(out + w * 3, 0, row_size - w * 3);
+            out += row_size;
+        }
+
+        iovec iov = { file.data(), file.size() };
+        ok = writev_all(fd, &iov, 1);
+    } else {
+        static uint8_t zeros[4] = {};
+        const uint32_t row_padding = row_byte_size(w, 8) - w;
+
+        uint8_t header[MAX_HEADER_SIZE];
+        std::vector<iovec> iov;
+        iov.push_back({ header, encode_header(header, w, h, 8) });
+        if (stride == w && row_padding == 0) {
+            iov.push_back({ const_cast<uint8_t *>(pixels), size_t(w) * h });
+        } else {
+            for (uint32_t y = 0; y < h; ++y) {
+                auto row = const_cast<uint8_t *>(pixels + size_t(y) * stride);
+                iov.push_back({ row, w });
+                if (row_padding > 0)
+                    iov.push_back({ zeros, row_padding });
+            }
+        }
+        ok = writev_all(fd, iov.data(), iov.size());
+    }
+
+    if (close(fd) != 0)
+        ok = false;
+    return ok;
+}
@@ -2,20 +2,37 @@
 
 #include "defs.hpp"
 
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 
-union RGBA
-{
-    uint32_t rgba;
-    struct
-    {
-        uint8_t r;
-        uint8_t g;
-        uint8_t b;
-        uint8_t a;
-    };
-};
+// The pixels are 8 bit luminances, written as gray 24 bit pixels or as 8 bit
+// indices into a color table of the gray levels.
 
+// converts n luminances to the 3 byte blue, green, red layout of 24 bit bmp
+void
+gray_to_bgr(const uint8_t *src, uint8_t *dst, uint32_t n);
+
+// size of a bmp file with bpp (24 or 8) bits per pixel
+size_t
+bmp_file_size(uint32_t w, uint32_t h, uint32_t bpp);
+
+// rows of pixels are stride pixels apart
+bool
+write_bmp(FILE *out,
+          uint32_t w,
+          uint32_t h,
+          uint32_t stride,
+          const uint8_t *pixels);
+
+// Writes a bmp file with a single write or writev. With 24 bits per pixel
+// the pixels are converted into a buffer of the whole file, which is kept
+// per thread. With 8 bits per pixel the rows are written straight from
+// pixels.
 bool
-write_bmp(FILE *out, uint32_t w, uint32_t h, const RGBA *pixels);
+write_bmp_file(const char *path,
+               uint32_t w,
+               uint32_t h,
+               uint32_t stride,
+               const uint8_t *pixels,
+               uint32_t bpp);
@@ -1,23 +1,141 @@
 #include "Config.hpp"
 
-#include "simd_vec.hpp"
+#include "render_kernels.hpp"
+#include "topology.hpp"
 
+#include <algorithm>
 #include <cstring>
 
+static const char *const ISA_NAMES[] = { "auto", "sse2", "avx2", "avx512" };
+
+static const char *const COSINE_NAMES[] = { "table",
+                                            "poly-low",
+                                            "poly-medium",
+                                            "poly-high",
+                                            "quarter",
+                                            "quarter16" };
+
+static const char *const WARP_NAMES[] = { "legacy",
+                                          "none",
+                                          "radial",
+                                          "anisotropic" };
+
+static const char *const AMPLITUDES_NAMES[] = { "direct",
+                                                "recurrence",
+                                                "separable" };
+
+static const char *const SCHED_NAMES[] = { "steal", "counter", "static" };
+
+static const char *const AFFINITY_NAMES[] = { "none",
+                                              "compact",
+                                              "scatter",
+                                              "cores" };
+
+static const char *const CAPTURE_FORMAT_NAMES[] = { "bmp",
+                                                    "bmp8",
+                                                    "y4m",
+                                                    "gray",
+                                                    "gif" };
+
+static const char *const CAPTURE_POLICY_NAMES[] = { "block", "drop" };
+
+template<typename E, size_t N>
+static bool
+parse_choice(const char *arg, const char *const (&names)[N], E &out)
+{
+    for (size_t i = 0; i < N; ++i) {
+        if (strcmp(arg, names[i]) == 0) {
+            out = E(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *
+Config::isa_name(KernelIsa isa)
+{
+    return ISA_NAMES[size_t(isa)];
+}
+
+const char *
+Config::cosine_name(CosineMode mode)
+{
+    return COSINE_NAMES[size_t(mode)];
+}
+
+const char *
+Config::warp_name(WarpMode mode)
+{
+    return WARP_NAMES[size_t(mode)];
+}
+
+bool
+Config::warp_is_affine(WarpMode mode)
+{
+    return mode == WarpMode::Legacy || mode == WarpMode::None;
+}
+
+const char *
+Config::amplitudes_name(AmplitudeKernel kernel)
+{
+    return AMPLITUDES_NAMES[size_t(kernel)];
+}
+
+const char *
+Config::sched_name(SchedPolicy policy)
+{
+    return SCHED_NAMES[size_t(policy)];
+}
+
+const char *
+Config::affinity_name(AffinityPolicy policy)
+{
+    return AFFINITY_NAMES[size_t(policy)];
+}
+
+const char *
+Config::capture_format_name(CaptureFormat format)
+{
+    return CAPTURE_FORMAT_NAMES[size_t(format)];
+}
+
+bool
+Config::format_is_stream(CaptureFormat format)
+{
+    return format == CaptureFormat::Y4m || format == CaptureFormat::Gray ||
+           format == CaptureFormat::Gif;
+}
+
+const char *
+Config::capture_policy_name(CapturePolicy policy)
+{
+    return CAPTURE_POLICY_NAMES[size_t(policy)];
+}
+
 std::optional<Config>
 Config::parse_args(int argc, char **const argv)
 {
     Config conf;
+    bool auto_workers = false;
     bool need_arg = false;
     char optchar = 0;
     for (int i = 1; i < argc; ++i) {
         if (need_arg) {
             need_arg = false;
+            if (optchar == 'j' && strcmp(argv[i], "auto") == 0) {
+                auto_workers = true;
+                continue;
+            }
             switch (optchar) {
             case 'j':
             case 'n':
             case 'f':
             case 'C':
+            case 'B':
+            case 'q':
+            case 'W':
+            case 'd':
             case 'c': {
                 char *endp = nullptr;
                 auto n = strtoll(argv[i], &endp, 10);
@@ -47,6 +165,26 @@ Config::parse_args(int argc, char **const argv)
                         return {};
                     conf.ncapture = uint32_t(n);
                     break;
+                case 'B':
+                    if (n < 0 || n > (1 << 30))
+                        return {};
+                    conf.nbench = uint32_t(n);
+                    break;
+                case 'q':
+                    if (n < 2 || n > 64)
+                        return {};
+                    conf.nframes = uint32_t(n);
+                    break;
+                case 'W':
+                    if (n < 0 || n > 64)
+                        return {};
+                    conf.nwriters = uint32_t(n);
+                    break;
+                case 'd':
+                    if (n < 25 || n > 100)
+                        return {};
+                    conf.min_scale = uint32_t(n);
+                    break;
                 }
                 break;
             }
@@ -56,24 +194,84 @@ Config::parse_args(int argc, char **const argv)
                     return {};
                 if (!(0 < w && w < 4096 && 0 < h && h < 4096))
                     return {};
-
-                if (w % vecf_t::size != 0) {
+                conf.img_w = uint32_t(w);
+                conf.img_h = uint32_t(h);
+                break;
+            }
+            case 't': {
+                int w, h;
+                if (sscanf(argv[i], "%dx%d", &w, &h) != 2)
+                    return {};
+                if (!(0 < w && 0 < h && w * h <= int(MAX_TILE_PIXELS)))
+                    return {};
+                if (w % TILE_ALIGN != 0) {
                     fprintf(stderr,
-                            "invalid image width, has to be divisble by %d\n",
-                            int(vecf_t::size));
+                            "invalid tile width, has to be divisible by %d\n",
+                            int(TILE_ALIGN));
                     return {};
                 }
-                conf.img_w = uint32_t(w);
-                conf.img_h = uint32_t(h);
+                conf.tile_w = uint32_t(w);
+                conf.tile_h = uint32_t(h);
+                break;
+            }
+            case 'i':
+                if (!parse_choice(argv[i], ISA_NAMES, conf.isa))
+                    return {};
+                break;
+            case 'm':
+                if (!parse_choice(argv[i], COSINE_NAMES, conf.cosine))
+                    return {};
+                break;
+            case 'w':
+                if (!parse_choice(argv[i], WARP_NAMES, conf.warp))
+                    return {};
+                break;
+            case 'a':
+                if (!parse_choice(argv[i], AMPLITUDES_NAMES, conf.amplitudes))
+                    return {};
+                break;
+            case 'S':
+                if (!parse_choice(argv[i], SCHED_NAMES, conf.sched))
+                    return {};
+                break;
+            case 'A':
+                if (!parse_choice(argv[i], AFFINITY_NAMES, conf.affinity))
+                    return {};
+                break;
+            case 'R': {
+                unsigned from, to;
+                char end;
+                if (sscanf(argv[i], "%u:%u%c", &from, &to, &end) != 2 ||
+                    from >= to || to > (1u << 30))
+                    return {};
+                conf.first_frame = from;
+                conf.ncapture = to - from;
+                conf.frame_range = true;
                 break;
             }
+            case 'o':
+                conf.capture_output = argv[i];
+                break;
+            case 'L':
+                conf.stats_log = argv[i];
+                break;
+            case 'e':
+                if (!parse_choice(
+                      argv[i], CAPTURE_FORMAT_NAMES, conf.capture_format))
+                    return {};
+                break;
+            case 'b':
+                if (!parse_choice(
+                      argv[i], CAPTURE_POLICY_NAMES, conf.capture_policy))
+                    return {};
+                break;
             }
         } else {
             if (strlen(argv[i]) == 2 && argv[i][0] == '-') {
                 optchar = argv[i][1];
                 if (optchar == 'v') {
                     conf.verbose = true;
-                } else if (strchr("njscfC", optchar)) {
+                } else if (strchr("njstcfdCRBqWeobLimwaSA", optchar)) {
                     need_arg = true;
                 } else {
                     return {};
@@ -87,6 +285,16 @@ Config::parse_args(int argc, char **const argv)
     if (need_arg)
         return {};
 
+    // a gif has a header and a trailer, pieces of one can not be joined
+    if (conf.first_frame > 0 && conf.capture_format == CaptureFormat::Gif) {
+        fprintf(stderr, "-e gif can only capture ranges from frame 0\n");
+        return {};
+    }
+
+    if (auto_workers)
+        conf.nworkers = std::min(
+          CpuTopology::detect().auto_workers(conf.affinity), 256u);
+
     return { conf };
 }
 
@@ -97,9 +305,60 @@ Config::parse_args(int argc, char **const argv)
     "  -v          Enable verbose output\n"                                    \
     "  -n NWAVES   Number of WAVES in the crystal\n"                           \
     "  -c NCOS     Size of cos(x) lookup table\n"                              \
-    "  -j WORKERS  Use WORKERS number of threads\n"                            \
+    "  -j WORKERS  Use WORKERS number of threads, auto for one per cpu (or\n"  \
+    "              core with -A cores) this process may use\n"                 \
     "  -s WxH      Framebuffer size, W pixels wide and H pixels tall\n"        \
-    "  -C N        Capture only: save N frames without opening a window\n"
+    "  -t WxH      Tile size, W a multiple of 16 and W * H at most 8192\n"     \
+    "              (default 64x64)\n"                                          \
+    "  -d PERCENT  Dynamic resolution: frames that would miss their\n"         \
+    "              deadline are rendered at down to PERCENT (25 to 100,\n"     \
+    "              default 50) of the size given by -s and scaled up in the\n" \
+    "              window, 100 turns it off. -C and -B always render the\n"    \
+    "              full size, screenshots keep the size a frame had\n"         \
+    "  -C N        Capture only: save N frames without opening a window\n"     \
+    "  -R FROM:TO  Capture only: save frames FROM to TO - 1, each one\n"       \
+    "              rendered at the time of its index and numbered by it, so\n" \
+    "              a capture can be split over processes. Files get at\n"      \
+    "              least 6 digits, only a range from 0 writes the y4m\n"       \
+    "              header and gif ranges have to start at 0\n"                 \
+    "  -B N        Benchmark: render N frames as fast as possible, without\n"  \
+    "              a window or captures. Prints frame time percentiles and\n"  \
+    "              the time of every kernel stage to stderr and a JSON\n"      \
+    "              summary to stdout\n"                                        \
+    "  -q DEPTH    Frames in flight: render up to DEPTH - 1 frames ahead of\n" \
+    "              the one being shown or saved (default 3, at least 2)\n"     \
+    "  -W WRITERS  Threads writing captured frames (default 2), 0 writes\n"    \
+    "              them on the main thread\n"                                  \
+    "  -e FORMAT   Capture format: bmp (24 bit, default), bmp8, which is\n"    \
+    "              written without converting the pixels, or a stream of\n"    \
+    "              all frames: y4m (YUV4MPEG2 with constant chroma), gray\n"   \
+    "              (raw 8 bit luminance, top row first) or gif (an\n"          \
+    "              animation shown at -f FPS, compressed by the writers)\n"    \
+    "  -o PATH     File or fifo the stream formats are written to,\n"          \
+    "              - for stdout (default)\n"                                   \
+    "  -b POLICY   When the writers fall behind: block (default) rendering\n"  \
+    "              until DEPTH - 1 frames wait to be written, or drop\n"       \
+    "              frames beyond that\n"                                       \
+    "  -L PATH     Log what every worker did in every frame (tiles, steals,\n" \
+    "              time waiting and busy) as CSV to PATH. -v shows their\n"    \
+    "              percentiles over the last frames on the console\n"          \
+    "  -i ISA      Kernel instruction set: auto, sse2, avx2 or avx512\n"       \
+    "  -m COSINE   cos(x) engine: table (default), a polynomial with\n"        \
+    "              poly-low, poly-medium or poly-high accuracy, or an\n"       \
+    "              interpolated quarter wave table of floats (quarter)\n"      \
+    "              or int16 (quarter16), at 1/8 of the size given by -c\n"     \
+    "  -w WARP     World warp: legacy (default, a uniform scale), none, or\n"  \
+    "              ripples around the center: radial or anisotropic\n"         \
+    "  -a KERNEL   Amplitude kernel: direct (default); recurrence, which\n"    \
+    "              steps waves along the rows (needs -w legacy or none);\n"    \
+    "              or separable, which precomputes per pixel wave sums once\n" \
+    "              and then costs two multiply-adds per pixel and frame\n"     \
+    "  -S SCHED    Tile scheduler: steal (default, lock-free deques with\n"    \
+    "              random stealing), counter (one shared atomic counter)\n"    \
+    "              or static (a fixed slice per worker)\n"                     \
+    "  -A AFFINITY Pin the workers to cpus: none (default), compact (fill\n"   \
+    "              one NUMA node and core after the other), scatter (spread\n" \
+    "              over nodes and cores) or cores (one per physical core)\n"
 
 void
 Config::print_usage()
@@ -4,6 +4,70 @@
 
 #include <cstdint>
 #include <optional>
+#include <string>
+
+enum class KernelIsa
+{
+    Auto,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+enum class CosineMode
+{
+    Table,
+    PolyLow,
+    PolyMedium,
+    PolyHigh,
+    Quarter,
+    Quarter16
+};
+
+enum class WarpMode
+{
+    Legacy,
+    None,
+    Radial,
+    Anisotropic
+};
+
+enum class AmplitudeKernel
+{
+    Direct,
+    Recurrence,
+    Separable
+};
+
+enum class SchedPolicy
+{
+    Steal,
+    Counter,
+    Static
+};
+
+enum class AffinityPolicy
+{
+    None,
+    Compact,
+    Scatter,
+    Cores
+};
+
+enum class CaptureFormat
+{
+    Bmp24,
+    Bmp8,
+    Y4m,
+    Gray,
+    Gif
+};
+
+enum class CapturePolicy
+{
+    Block,
+    Drop
+};
 
 struct Config
 {
@@ -11,14 +75,57 @@ struct Config
     uint32_t nworkers = 1;
     uint32_t img_w = 800;
     uint32_t img_h = 600;
+    uint32_t tile_w = 64;
+    uint32_t tile_h = 64;
     uint32_t nwaves = 7;
     uint32_t ncosines = 1024;
     uint32_t fps = 30;
+    // lowest resolution the window renders at to keep up with fps, in percent
+    // of img_w and img_h, 100 always renders the full size
+    uint32_t min_scale = 50;
     float time_speed = 0.25;
     float time_t0 = 0;
     uint32_t ncapture = 0;
+    // capture frames [first_frame, first_frame + ncapture) of the animation
+    // instead of the first ncapture (-R)
+    uint32_t first_frame = 0;
+    bool frame_range = false;
+    // frames rendered by the headless benchmark, 0 runs the animation
+    uint32_t nbench = 0;
+    // depth of the frame ring, up to nframes - 1 frames are rendered ahead
+    uint32_t nframes = 3;
+    // threads writing captured frames, 0 writes them on the main thread
+    uint32_t nwriters = 2;
+    CaptureFormat capture_format = CaptureFormat::Bmp24;
+    // file or fifo the stream formats are written to, - is stdout
+    std::string capture_output = "-";
+    CapturePolicy capture_policy = CapturePolicy::Block;
+    // CSV file receiving the statistics of every worker and frame, none if
+    // empty
+    std::string stats_log;
+    KernelIsa isa = KernelIsa::Auto;
+    CosineMode cosine = CosineMode::Table;
+    WarpMode warp = WarpMode::Legacy;
+    AmplitudeKernel amplitudes = AmplitudeKernel::Direct;
+    SchedPolicy sched = SchedPolicy::Steal;
+    AffinityPolicy affinity = AffinityPolicy::None;
 
     static std::optional<Config> parse_args(int argc, char *argv[]);
 
     static void print_usage();
+
+    static const char *isa_name(KernelIsa);
+    static const char *cosine_name(CosineMode);
+    static const char *warp_name(WarpMode);
+    // legacy and none warps are affine maps, they can be folded into the
+    // pixel to world transform
+    static bool warp_is_affine(WarpMode);
+    static const char *amplitudes_name(AmplitudeKernel);
+    static const char *sched_name(SchedPolicy);
+    static const char *affinity_name(AffinityPolicy);
+    static const char *capture_format_name(CaptureFormat);
+    // stream formats write all frames to capture_output instead of one file
+    // per frame
+    static bool format_is_stream(CaptureFormat);
+    static const char *capture_policy_name(CapturePolicy);
 };
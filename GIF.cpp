@@ -0,0 +1,187 @@
+#include "GIF.hpp"
+
+#include <cstring>
+
+static void
+append_u16(std::vector<uint8_t> &out, uint32_t x)
+{
+    out.push_back(uint8_t(x));
+    out.push_back(uint8_t(x >> 8));
+}
+
+void
+gif_append_header(std::vector<uint8_t> &out, uint32_t w, uint32_t h)
+{
+    static const char SIGNATURE[] = "GIF89a";
+    out.insert(out.end(), SIGNATURE, SIGNATURE + 6);
+
+    // logical screen: global color table of 2^8 colors with 8 bit channels
+    append_u16(out, w);
+    append_u16(out, h);
+    out.push_back(0xf7);
+    out.push_back(0); // background color
+    out.push_back(0); // aspect ratio
+
+    for (uint32_t i = 0; i < 256; ++i)
+        out.insert(out.end(), 3, uint8_t(i));
+
+    // application extension: loop forever
+    static const uint8_t NETSCAPE[] = { 0x21, 0xff, 11,  'N', 'E', 'T', 'S',
+                                        'C',  'A',  'P', 'E', '2', '.', '0',
+                                        3,    1,    0,   0,   0 };
+    out.insert(out.end(), NETSCAPE, NETSCAPE + sizeof NETSCAPE);
+}
+
+// Packs codes LSB first into data sub-blocks of up to 255 bytes, each after
+// a length byte.
+struct SubBlockWriter
+{
+    std::vector<uint8_t> &out;
+    size_t block = 0;
+    uint32_t acc = 0;
+    uint32_t nbits = 0;
+
+    explicit SubBlockWriter(std::vector<uint8_t> &out) : out(out)
+    {
+        start_block();
+    }
+
+    void start_block()
+    {
+        block = out.size();
+        out.push_back(0);
+    }
+
+    void put_byte(uint8_t b)
+    {
+        if (out.size() - block > 255) {
+            out[block] = 255;
+            start_block();
+        }
+        out.push_back(b);
+    }
+
+    void put(uint32_t code, uint32_t size)
+    {
+        acc |= code << nbits;
+        nbits += size;
+        while (nbits >= 8) {
+            put_byte(uint8_t(acc));
+            acc >>= 8;
+            nbits -= 8;
+        }
+    }
+
+    // flushes the remaining bits and terminates the sub-blocks
+    void finish()
+    {
+        if (nbits > 0)
+            put_byte(uint8_t(acc));
+        out[block] = uint8_t(out.size() - block - 1);
+        if (out[block] != 0)
+            out.push_back(0);
+    }
+};
+
+// GIF flavoured LZW with 8 bit symbols: codes grow from 9 to 12 bits, the
+// table is cleared once it is full. Strings are looked up as (prefix code,
+// symbol) pairs in an open addressing hash table. The rows of pixels are
+// stride bytes apart.
+static void
+lzw_encode(std::vector<uint8_t> &out,
+           const uint8_t *pixels,
+           ptrdiff_t stride,
+           uint32_t w,
+           uint32_t h)
+{
+    const uint32_t MIN_CODE_SIZE = 8;
+    const uint32_t CLEAR = 1 << MIN_CODE_SIZE;
+    const uint32_t END = CLEAR + 1;
+    const uint32_t MAX_CODE = 4095;
+    const uint32_t TABLE_SIZE = 1 << 13;
+    const uint32_t EMPTY = ~0u;
+
+    uint32_t keys[TABLE_SIZE];
+    uint16_t codes[TABLE_SIZE];
+
+    out.push_back(uint8_t(MIN_CODE_SIZE));
+    SubBlockWriter bits(out);
+
+    uint32_t code_size = MIN_CODE_SIZE + 1;
+    uint32_t last_code = END;
+    memset(keys, 0xff, sizeof keys);
+    bits.put(CLEAR, code_size);
+
+    if (w == 0 || h == 0) {
+        bits.put(END, code_size);
+        bits.finish();
+        return;
+    }
+
+    // the decoder assigns a code for every code it reads (for the first one
+    // after a clear only in its count), last_code mirrors that count and the
+    // code size grows as soon as the next code does not fit anymore
+    auto emitted = [&] {
+        ++last_code;
+        if (last_code >= (1u << code_size) && code_size < 12)
+            ++code_size;
+    };
+
+    uint32_t prefix = pixels[0];
+    for (uint32_t y = 0; y < h; ++y) {
+        const uint8_t *row = pixels + y * stride;
+        for (uint32_t x = y == 0 ? 1 : 0; x < w; ++x) {
+            const uint32_t key = prefix << 8 | row[x];
+            uint32_t slot = (key * 2654435761u) >> (32 - 13);
+            while (keys[slot] != EMPTY && keys[slot] != key)
+                slot = (slot + 1) & (TABLE_SIZE - 1);
+            if (keys[slot] == key) {
+                prefix = codes[slot];
+                continue;
+            }
+
+            bits.put(prefix, code_size);
+            keys[slot] = key;
+            codes[slot] = uint16_t(last_code + 1);
+            emitted();
+            if (last_code == MAX_CODE) {
+                bits.put(CLEAR, code_size);
+                memset(keys, 0xff, sizeof keys);
+                code_size = MIN_CODE_SIZE + 1;
+                last_code = END;
+            }
+            prefix = row[x];
+        }
+    }
+
+    bits.put(prefix, code_size);
+    emitted();
+    bits.put(END, code_size);
+    bits.finish();
+}
+
+void
+gif_append_frame(std::vector<uint8_t> &out,
+                 const uint8_t *pixels,
+                 ptrdiff_t stride,
+                 uint32_t w,
+                 uint32_t h,
+                 uint16_t delay)
+{
+    // graphic control extension: no disposal, no transparency
+    static const uint8_t GCE[] = { 0x21, 0xf9, 4, 0x04 };
+    out.insert(out.end(), GCE, GCE + sizeof GCE);
+    append_u16(out, delay);
+    out.push_back(0); // transparent color
+    out.push_back(0);
+
+    // image descriptor covering the whole screen, no local color table
+    out.push_back(0x2c);
+    append_u16(out, 0);
+    append_u16(out, 0);
+    append_u16(out, w);
+    append_u16(out, h);
+    out.push_back(0);
+
+    lzw_encode(out, pixels, stride, w, h);
+}
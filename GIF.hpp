@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Animated GIFs of 8 bit gray frames: the global color table holds the 256
+// gray levels, so a frame is its luminance plane compressed with LZW and the
+// frames of an animation can be encoded independently of each other.
+
+const uint8_t GIF_TRAILER = 0x3b;
+
+// appends the header and the global color table of an animation that loops
+// forever
+void
+gif_append_header(std::vector<uint8_t> &out, uint32_t w, uint32_t h);
+
+// appends a frame of w * h gray levels, shown for delay 1/100 seconds. The
+// rows are stride bytes apart, a negative stride stores them bottom up.
+void
+gif_append_frame(std::vector<uint8_t> &out,
+                 const uint8_t *pixels,
+                 ptrdiff_t stride,
+                 uint32_t w,
+                 uint32_t h,
+                 uint16_t delay);
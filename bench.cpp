@@ -0,0 +1,1027 @@
+#include "BMP.hpp"
+#include "render.hpp"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+// Micro benchmarks of the renderer internals. Everything runs single threaded
+// on a full frame and is reported per pixel. Hardware counters are read
+// through perf_event_open; where the kernel does not allow that (containers,
+// perf_event_paranoid) cycles fall back to the time stamp counter and the
+// other counters are reported as n/a.
+
+struct PerfCounter
+{
+    int fd = -1;
+
+    PerfCounter(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~PerfCounter()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    PerfCounter(const PerfCounter &) = delete;
+    PerfCounter &operator=(const PerfCounter &) = delete;
+
+    bool available() const { return fd >= 0; }
+
+    void start()
+    {
+        if (fd < 0)
+            return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    uint64_t stop()
+    {
+        uint64_t count = 0;
+        if (fd < 0)
+            return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof count) != sizeof count)
+            return 0;
+        return count;
+    }
+};
+
+const uint64_t L1D_READ_MISS = PERF_COUNT_HW_CACHE_L1D |
+                               (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+struct BenchOptions
+{
+    uint32_t img_w = 1920;
+    uint32_t img_h = 1080;
+    uint32_t tile_w = Config().tile_w;
+    uint32_t tile_h = Config().tile_h;
+    uint32_t reps = 5;
+    uint32_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+typedef void (*DrawTile)(const KernelArgs &,
+                         const Rect &,
+                         uint32_t,
+                         uint8_t *);
+
+struct FrameCost
+{
+    double cycles; // per pixel
+    double l1_misses; // per pixel, negative if not available
+};
+
+// renders the frame reps times tile by tile, the fastest run is reported
+static FrameCost
+measure_frame(DrawTile draw_tile,
+              const KernelArgs &args,
+              const TileGrid &grid,
+              Image &img,
+              uint32_t reps,
+              PerfCounter &cycles,
+              PerfCounter &l1_misses)
+{
+    const uint32_t npixels = img.w * img.h;
+    const uint32_t ntiles = grid.ntiles();
+
+    FrameCost best = { -1, -1 };
+    for (uint32_t r = 0; r <= reps; ++r) {
+        cycles.start();
+        l1_misses.start();
+        uint64_t t0 = __rdtsc();
+
+        for (uint32_t i = 0; i < ntiles; ++i)
+            draw_tile(args, grid.rect(i), img.stride, img.data());
+
+        uint64_t ticks = __rdtsc() - t0;
+        uint64_t misses = l1_misses.stop();
+        if (cycles.available())
+            ticks = cycles.stop();
+
+        // the first run only warms up caches and tables
+        if (r == 0)
+            continue;
+
+        FrameCost cost;
+        cost.cycles = double(ticks) / npixels;
+        cost.l1_misses =
+          l1_misses.available() ? double(misses) / npixels : -1;
+        if (best.cycles < 0 || cost.cycles < best.cycles)
+            best.cycles = cost.cycles;
+        if (best.l1_misses < 0 || cost.l1_misses < best.l1_misses)
+            best.l1_misses = cost.l1_misses;
+    }
+
+    return best;
+}
+
+static void
+print_cost(double x)
+{
+    if (x < 0)
+        printf(" %9s", "n/a");
+    else
+        printf(" %9.2f", x);
+}
+
+struct FusedCase
+{
+    CosineMode cosine;
+    AmplitudeKernel amplitudes;
+    uint32_t nwaves;
+};
+
+// staged (one pass over the tile per stage and wave) against fused (register
+// blocked) tile kernels
+static bool
+bench_fused(const BenchOptions &opts)
+{
+    static const FusedCase cases[] = {
+        { CosineMode::Table, AmplitudeKernel::Direct, 7 },
+        { CosineMode::Table, AmplitudeKernel::Direct, 24 },
+        { CosineMode::PolyLow, AmplitudeKernel::Direct, 7 },
+        { CosineMode::PolyLow, AmplitudeKernel::Direct, 24 },
+        { CosineMode::PolyHigh, AmplitudeKernel::Direct, 7 },
+        { CosineMode::PolyHigh, AmplitudeKernel::Direct, 24 },
+        { CosineMode::Quarter16, AmplitudeKernel::Direct, 7 },
+        { CosineMode::Quarter16, AmplitudeKernel::Direct, 24 },
+        { CosineMode::PolyHigh, AmplitudeKernel::Recurrence, 7 },
+        { CosineMode::PolyHigh, AmplitudeKernel::Recurrence, 24 },
+    };
+
+    PerfCounter cycles(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    PerfCounter l1_misses(PERF_TYPE_HW_CACHE, L1D_READ_MISS);
+
+    printf("fused: %ux%u, best of %u, %s per pixel\n",
+           unsigned(opts.img_w),
+           unsigned(opts.img_h),
+           unsigned(opts.reps),
+           cycles.available() ? "core cycles" : "tsc ticks");
+    printf("%-7s %-10s %-10s %5s %9s %9s %9s %9s\n",
+           "isa",
+           "cosine",
+           "amplitude",
+           "waves",
+           "staged",
+           "fused",
+           "L1 staged",
+           "L1 fused");
+
+    Config conf;
+    conf.img_w = opts.img_w;
+    conf.img_h = opts.img_h;
+    conf.tile_w = opts.tile_w;
+    conf.tile_h = opts.tile_h;
+    conf.warp = WarpMode::None;
+
+    Image img;
+    img.init(opts.img_w, opts.img_h);
+    TileGrid grid;
+    grid.init(opts.img_w, opts.img_h, opts.tile_w, opts.tile_h);
+
+    Transforms trafos;
+    trafos.init(opts.img_w, opts.img_h);
+
+    for (KernelIsa isa :
+         { KernelIsa::SSE2, KernelIsa::AVX2, KernelIsa::AVX512 }) {
+        const RenderKernels *kernels = select_render_kernels(isa);
+        if (!kernels)
+            continue;
+
+        for (const FusedCase &c : cases) {
+            conf.cosine = c.cosine;
+            conf.amplitudes = c.amplitudes;
+
+            Uniforms uniforms;
+            uniforms.init(c.nwaves, conf.ncosines);
+            uniforms.time = 1.25;
+            std::vector<float> waves;
+            const KernelArgs args =
+              make_kernel_args(conf, uniforms, trafos, waves);
+
+            FrameCost staged = measure_frame(kernels->draw_tile_staged,
+                                             args,
+                                             grid,
+                                             img,
+                                             opts.reps,
+                                             cycles,
+                                             l1_misses);
+            FrameCost fused = measure_frame(kernels->draw_tile,
+                                            args,
+                                            grid,
+                                            img,
+                                            opts.reps,
+                                            cycles,
+                                            l1_misses);
+
+            printf("%-7s %-10s %-10s %5u",
+                   kernels->isa,
+                   Config::cosine_name(c.cosine),
+                   Config::amplitudes_name(c.amplitudes),
+                   unsigned(c.nwaves));
+            print_cost(staged.cycles);
+            print_cost(fused.cycles);
+            print_cost(staged.l1_misses);
+            print_cost(fused.l1_misses);
+            printf("\n");
+        }
+    }
+
+    return true;
+}
+
+struct StageCase
+{
+    uint32_t tile_w, tile_h;
+    uint32_t nwaves;
+    CosineMode cosine;
+    uint32_t ncosines;
+};
+
+// the stages of the staged kernel, each timed on its own over whole tiles by
+// RenderKernels::profile_tile. The time stamp counter is converted to core
+// cycles with the cycle counter of the same runs where that is available.
+// The radial warp keeps the warp stage busy, the amplitudes are also given
+// per wave, which is mostly the cost of the cosine engine.
+static bool
+bench_stages(const BenchOptions &opts)
+{
+    const uint32_t tw = opts.tile_w, th = opts.tile_h;
+    const StageCase cases[] = {
+        { 16, 16, 7, CosineMode::Table, 1024 },
+        { 32, 32, 7, CosineMode::Table, 1024 },
+        { 64, 64, 7, CosineMode::Table, 1024 },
+        { 128, 64, 7, CosineMode::Table, 1024 },
+        { tw, th, 1, CosineMode::Table, 1024 },
+        { tw, th, 24, CosineMode::Table, 1024 },
+        { tw, th, 64, CosineMode::Table, 1024 },
+        { tw, th, 7, CosineMode::Table, 256 },
+        { tw, th, 7, CosineMode::Table, 1 << 14 },
+        { tw, th, 7, CosineMode::Table, 1 << 18 },
+        { tw, th, 7, CosineMode::PolyLow, 1024 },
+        { tw, th, 7, CosineMode::PolyHigh, 1024 },
+        { tw, th, 7, CosineMode::Quarter, 1024 },
+        { tw, th, 7, CosineMode::Quarter16, 1024 },
+        { tw, th, 7, CosineMode::Quarter16, 1 << 14 },
+    };
+
+    PerfCounter cycles(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+
+    printf("stages: %ux%u, radial warp, best of %u, %s per pixel\n",
+           unsigned(opts.img_w),
+           unsigned(opts.img_h),
+           unsigned(opts.reps),
+           cycles.available() ? "core cycles" : "tsc ticks");
+    printf("%-7s %7s %5s %-10s %6s",
+           "isa",
+           "tile",
+           "waves",
+           "cosine",
+           "ncos");
+    for (uint32_t s = 0; s < NUM_RENDER_STAGES; ++s)
+        printf(" %10s", render_stage_name(RenderStage(s)));
+    printf(" %9s\n", "amp/wave");
+
+    Config conf;
+    conf.img_w = opts.img_w;
+    conf.img_h = opts.img_h;
+    conf.warp = WarpMode::Radial;
+
+    Image img;
+    img.init(opts.img_w, opts.img_h);
+    Transforms trafos;
+    trafos.init(opts.img_w, opts.img_h);
+    const double npixels = double(img.w) * img.h;
+
+    for (KernelIsa isa :
+         { KernelIsa::SSE2, KernelIsa::AVX2, KernelIsa::AVX512 }) {
+        const RenderKernels *kernels = select_render_kernels(isa);
+        if (!kernels)
+            continue;
+
+        for (const StageCase &c : cases) {
+            conf.tile_w = c.tile_w;
+            conf.tile_h = c.tile_h;
+            conf.cosine = c.cosine;
+            conf.ncosines = c.ncosines;
+            TileGrid grid;
+            grid.init(opts.img_w, opts.img_h, c.tile_w, c.tile_h);
+
+            Uniforms uniforms;
+            uniforms.init(c.nwaves, c.ncosines);
+            uniforms.time = 1.25;
+            std::vector<float> waves;
+            const KernelArgs args =
+              make_kernel_args(conf, uniforms, trafos, waves);
+
+            double best[NUM_RENDER_STAGES];
+            for (uint32_t r = 0; r <= opts.reps; ++r) {
+                uint64_t ticks[NUM_RENDER_STAGES] = {};
+                cycles.start();
+                uint64_t t0 = __rdtsc();
+                for (uint32_t i = 0; i < grid.ntiles(); ++i)
+                    kernels->profile_tile(
+                      args, grid.rect(i), img.stride, img.data(), ticks);
+                uint64_t total = __rdtsc() - t0;
+                double scale = 1;
+                if (cycles.available() && total > 0)
+                    scale = double(cycles.stop()) / double(total);
+
+                // the first run only warms up caches and tables
+                for (uint32_t s = 0; s < NUM_RENDER_STAGES; ++s) {
+                    double x = double(ticks[s]) * scale / npixels;
+                    if (r == 1 || (r > 1 && x < best[s]))
+                        best[s] = x;
+                }
+            }
+
+            char tile[16];
+            snprintf(tile,
+                     sizeof tile,
+                     "%ux%u",
+                     unsigned(c.tile_w),
+                     unsigned(c.tile_h));
+            printf("%-7s %7s %5u %-10s %6u",
+                   kernels->isa,
+                   tile,
+                   unsigned(c.nwaves),
+                   Config::cosine_name(c.cosine),
+                   unsigned(c.ncosines));
+            for (double x : best)
+                print_cost(x);
+            print_cost(best[STAGE_AMPLITUDES] /
+                       (uniforms.nsingle + uniforms.npaired));
+            printf("\n");
+        }
+    }
+
+    return true;
+}
+
+// Runs nframes frames of ntiles tiles on nthreads threads, the calling thread
+// is worker 0 and starts the frames. Returns the wall time per frame in
+// seconds.
+template<typename Work>
+static double
+run_frames(TileScheduler &sched,
+           uint32_t ntiles,
+           uint32_t nframes,
+           Work &&work)
+{
+    const uint32_t nthreads = sched.nworkers();
+    std::atomic<uint32_t> started(0);
+    std::atomic<uint32_t> finished(0);
+    std::atomic<bool> quit(false);
+
+    auto render_frame = [&](uint32_t id) {
+        uint32_t tile;
+        while (sched.next_tile(id, tile))
+            work(tile);
+        finished.fetch_add(1, std::memory_order_acq_rel);
+    };
+
+    auto worker = [&](uint32_t id) {
+        uint32_t seen = 0;
+        for (;;) {
+            uint32_t frame;
+            while ((frame = started.load(std::memory_order_acquire)) == seen) {
+                if (quit.load(std::memory_order_acquire))
+                    return;
+                std::this_thread::yield();
+            }
+            seen = frame;
+            render_frame(id);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (uint32_t id = 1; id < nthreads; ++id)
+        threads.emplace_back(worker, id);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint32_t f = 0; f < nframes; ++f) {
+        sched.start_frame(ntiles);
+        finished.store(0, std::memory_order_relaxed);
+        started.store(f + 1, std::memory_order_release);
+        render_frame(0);
+        while (finished.load(std::memory_order_acquire) < nthreads)
+            std::this_thread::yield();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    quit.store(true, std::memory_order_release);
+    for (auto &t : threads)
+        t.join();
+
+    return std::chrono::duration<double>(t1 - t0).count() / nframes;
+}
+
+// a dependent chain of n xorshift steps, the result goes into a sink so the
+// work can not be dropped
+static void
+spin_work(uint32_t n)
+{
+    static std::atomic<uint32_t> sink;
+    uint32_t x = n | 1;
+    for (uint32_t i = 0; i < n; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    }
+    sink.store(x, std::memory_order_relaxed);
+}
+
+// every policy at thread counts up to -j: scheduling overhead on empty tiles,
+// a synthetic frame whose tiles get more expensive towards the end (so that
+// fixed slices are imbalanced) and a real frame
+static bool
+bench_sched(const BenchOptions &opts)
+{
+    const uint32_t EMPTY_TILES = 1 << 16;
+    const uint32_t SKEWED_TILES = 1 << 12;
+
+    Config conf;
+    conf.img_w = opts.img_w;
+    conf.img_h = opts.img_h;
+    conf.tile_w = opts.tile_w;
+    conf.tile_h = opts.tile_h;
+    conf.cosine = CosineMode::PolyLow;
+    conf.warp = WarpMode::None;
+
+    Image img;
+    img.init(opts.img_w, opts.img_h);
+    TileGrid grid;
+    grid.init(opts.img_w, opts.img_h, opts.tile_w, opts.tile_h);
+    const uint32_t render_tiles = grid.ntiles();
+
+    Uniforms uniforms;
+    uniforms.init(conf.nwaves, conf.ncosines);
+    Transforms trafos;
+    trafos.init(opts.img_w, opts.img_h);
+    std::vector<float> waves;
+    const KernelArgs args = make_kernel_args(conf, uniforms, trafos, waves);
+    const RenderKernels *kernels = select_render_kernels(KernelIsa::Auto);
+
+    std::vector<uint32_t> thread_counts;
+    for (uint32_t n = 1; n < opts.max_threads; n *= 2)
+        thread_counts.push_back(n);
+    thread_counts.push_back(opts.max_threads);
+
+    printf("sched: %u empty tiles, %u skewed tiles, %ux%u %s frame (%s)\n",
+           unsigned(EMPTY_TILES),
+           unsigned(SKEWED_TILES),
+           unsigned(img.w),
+           unsigned(img.h),
+           Config::cosine_name(conf.cosine),
+           kernels->isa);
+    printf("%-8s %7s %9s %9s %9s\n",
+           "policy",
+           "threads",
+           "ns/tile",
+           "skewed ms",
+           "render ms");
+
+    std::unique_ptr<std::atomic<uint32_t>[]> claims(
+      new std::atomic<uint32_t>[EMPTY_TILES]);
+
+    for (SchedPolicy policy :
+         { SchedPolicy::Steal, SchedPolicy::Counter, SchedPolicy::Static }) {
+        for (uint32_t n : thread_counts) {
+            TileScheduler sched(policy, n);
+
+            // every tile has to be handed out exactly once
+            for (uint32_t i = 0; i < EMPTY_TILES; ++i)
+                claims[i].store(0, std::memory_order_relaxed);
+            run_frames(sched, EMPTY_TILES, 1, [&](uint32_t tile) {
+                claims[tile].fetch_add(1, std::memory_order_relaxed);
+            });
+            for (uint32_t i = 0; i < EMPTY_TILES; ++i) {
+                if (claims[i].load(std::memory_order_relaxed) != 1) {
+                    fprintf(stderr,
+                            "%s scheduler with %u threads handed out "
+                            "tile %u %u times\n",
+                            Config::sched_name(policy),
+                            unsigned(n),
+                            unsigned(i),
+                            unsigned(claims[i].load()));
+                    return false;
+                }
+            }
+
+            double empty = run_frames(
+              sched, EMPTY_TILES, opts.reps * 4, [](uint32_t) {});
+            double skewed =
+              run_frames(sched, SKEWED_TILES, opts.reps, [&](uint32_t tile) {
+                  spin_work(64 + tile);
+              });
+            double render =
+              run_frames(sched, render_tiles, opts.reps, [&](uint32_t tile) {
+                  kernels->draw_tile(
+                    args, grid.rect(tile), img.stride, img.data());
+              });
+
+            printf("%-8s %7u %9.1f %9.2f %9.2f\n",
+                   Config::sched_name(policy),
+                   unsigned(n),
+                   empty * 1e9 / EMPTY_TILES,
+                   skewed * 1e3,
+                   render * 1e3);
+        }
+    }
+
+    return true;
+}
+
+// the per pixel conversion to compare gray_to_bgr against
+static void
+gray_to_bgr_reference(const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i)
+        dst[3 * i] = dst[3 * i + 1] = dst[3 * i + 2] = src[i];
+}
+
+// seconds per call of f, the fastest of reps runs
+template<typename F>
+static double
+best_time(uint32_t reps, F &&f)
+{
+    double best = -1;
+    for (uint32_t r = 0; r <= reps; ++r) {
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = f();
+        auto t1 = std::chrono::steady_clock::now();
+        if (!ok)
+            return -1;
+        double t = std::chrono::duration<double>(t1 - t0).count();
+        if (r > 0 && (best < 0 || t < best))
+            best = t;
+    }
+    return best;
+}
+
+// pixel conversion and bmp files written through stdio (as captures used to
+// be), with a single write after converting and as 8 bit gray straight from
+// the image; the files go to $TMPDIR, i.e. mostly the page cache
+static bool
+bench_bmp(const BenchOptions &opts)
+{
+    Config conf;
+    conf.img_w = opts.img_w;
+    conf.img_h = opts.img_h;
+    conf.tile_w = opts.tile_w;
+    conf.tile_h = opts.tile_h;
+
+    Image img;
+    img.init(opts.img_w, opts.img_h);
+    TileGrid grid;
+    grid.init(opts.img_w, opts.img_h, opts.tile_w, opts.tile_h);
+    Uniforms uniforms;
+    uniforms.init(conf.nwaves, conf.ncosines);
+    Transforms trafos;
+    trafos.init(opts.img_w, opts.img_h);
+    std::vector<float> waves;
+    const KernelArgs args = make_kernel_args(conf, uniforms, trafos, waves);
+    const RenderKernels *kernels = select_render_kernels(KernelIsa::Auto);
+    for (uint32_t i = 0; i < grid.ntiles(); ++i)
+        kernels->draw_tile(args, grid.rect(i), img.stride, img.data());
+
+    const char *tmpdir = getenv("TMPDIR");
+    const std::string path = std::string(tmpdir ? tmpdir : "/tmp") +
+                             "/crystal_bench_" + std::to_string(getpid()) +
+                             ".bmp";
+
+    std::vector<uint8_t> bgr(size_t(img.w) * 3);
+    auto convert = [&](auto f) {
+        return best_time(opts.reps, [&] {
+            for (uint32_t y = 0; y < img.h; ++y)
+                f(img.data() + size_t(y) * img.stride, bgr.data(), img.w);
+            return true;
+        });
+    };
+
+    // both conversions have to agree
+    std::vector<uint8_t> expected(bgr.size());
+    for (uint32_t y = 0; y < img.h; ++y) {
+        const uint8_t *row = img.data() + size_t(y) * img.stride;
+        gray_to_bgr_reference(row, expected.data(), img.w);
+        gray_to_bgr(row, bgr.data(), img.w);
+        if (bgr != expected) {
+            fprintf(stderr, "gray_to_bgr differs in row %u\n", unsigned(y));
+            return false;
+        }
+    }
+
+    struct Case
+    {
+        const char *name;
+        double seconds;
+        size_t bytes;
+    };
+
+    const size_t frame_bytes = size_t(img.w) * img.h;
+    Case cases[] = {
+        { "convert scalar", convert(gray_to_bgr_reference), frame_bytes },
+        { "convert simd", convert(gray_to_bgr), frame_bytes },
+        { "write stdio",
+          best_time(opts.reps,
+                    [&] {
+                        FILE *out = fopen(path.c_str(), "wb");
+                        if (!out)
+                            return false;
+                        bool ok = write_bmp(
+                          out, img.w, img.h, img.stride, img.data());
+                        return fclose(out) == 0 && ok;
+                    }),
+          bmp_file_size(img.w, img.h, 24) },
+        { "write 24 bit",
+          best_time(opts.reps,
+                    [&] {
+                        return write_bmp_file(path.c_str(),
+                                              img.w,
+                                              img.h,
+                                              img.stride,
+                                              img.data(),
+                                              24);
+                    }),
+          bmp_file_size(img.w, img.h, 24) },
+        { "write 8 bit",
+          best_time(opts.reps,
+                    [&] {
+                        return write_bmp_file(path.c_str(),
+                                              img.w,
+                                              img.h,
+                                              img.stride,
+                                              img.data(),
+                                              8);
+                    }),
+          bmp_file_size(img.w, img.h, 8) },
+    };
+    unlink(path.c_str());
+
+    printf("bmp: %ux%u, best of %u, files in %s\n",
+           unsigned(img.w),
+           unsigned(img.h),
+           unsigned(opts.reps),
+           tmpdir ? tmpdir : "/tmp");
+    printf("%-15s %9s %9s\n", "", "ms", "GB/s");
+    for (const Case &c : cases) {
+        if (c.seconds < 0) {
+            fprintf(stderr, "failed to write %s\n", path.c_str());
+            return false;
+        }
+        printf("%-15s %9.2f %9.2f\n",
+               c.name,
+               c.seconds * 1e3,
+               double(c.bytes) / c.seconds * 1e-9);
+    }
+
+    return true;
+}
+
+// The frame of args in double precision with exact cosines and every wave
+// evaluated on its own (no folding of opposite waves), shaded like the
+// kernels do. The frame rotation is assumed to be the identity.
+static void
+render_reference(const KernelArgs &args,
+                 uint32_t w,
+                 uint32_t h,
+                 std::vector<uint8_t> &out)
+{
+    const AffineTrafo2 &M = args.pixel_to_world;
+    const RippleWarp *warp = nullptr;
+    if (args.warp == WarpMode::Radial)
+        warp = &RADIAL_WARP;
+    else if (args.warp == WarpMode::Anisotropic)
+        warp = &ANISOTROPIC_WARP;
+
+    std::vector<double> kx(args.nangles), ky(args.nangles);
+    for (uint32_t a = 0; a < args.nangles; ++a) {
+        double theta = 2 * M_PI * a / args.nangles;
+        kx[a] = std::cos(theta);
+        ky[a] = std::sin(theta);
+    }
+
+    const double time = args.time;
+    out.resize(size_t(w) * h);
+    for (uint32_t py = 0; py < h; ++py) {
+        for (uint32_t px = 0; px < w; ++px) {
+            double x = px * double(M.x.x) + py * double(M.y.x) +
+                       double(M.origin.coords.x);
+            double y = px * double(M.x.y) + py * double(M.y.y) +
+                       double(M.origin.coords.y);
+            if (warp) {
+                double u = x * warp->ex, v = y * warp->ey;
+                double r = std::sqrt(u * u + v * v + 1e-6);
+                double s = 1 + warp->amplitude * std::cos(r * warp->freq) / r;
+                x *= s;
+                y *= s;
+            }
+
+            double amp = args.nangles;
+            for (uint32_t a = 0; a < args.nangles; ++a)
+                amp += std::cos(time + x * kx[a] + y * ky[a]);
+
+            double t = amp * 0.5;
+            t -= std::floor(t);
+            out[size_t(py) * w + px] = uint8_t(t * t * (3 - 2 * t) * 255);
+        }
+    }
+}
+
+struct ImageError
+{
+    double psnr; // in dB, infinite for identical images
+    uint32_t max;
+    double off_by_more_than_one; // share of the pixels
+};
+
+static ImageError
+compare_images(const std::vector<uint8_t> &ref, const Image &img)
+{
+    double sum = 0;
+    uint32_t max = 0;
+    size_t noff = 0;
+    for (uint32_t y = 0; y < img.h; ++y) {
+        for (uint32_t x = 0; x < img.w; ++x) {
+            int d = int(img(x, y)) - int(ref[size_t(y) * img.w + x]);
+            uint32_t e = uint32_t(std::abs(d));
+            sum += double(e) * e;
+            max = std::max(max, e);
+            noff += e > 1;
+        }
+    }
+
+    const double npixels = double(img.w) * img.h;
+    const double mse = sum / npixels;
+    ImageError err;
+    err.psnr = mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+    err.max = max;
+    err.off_by_more_than_one = double(noff) / npixels;
+    return err;
+}
+
+struct AccuracyCase
+{
+    CosineMode cosine;
+    AmplitudeKernel amplitudes;
+    WarpMode warp;
+    // the stated bound: the lowest PSNR in dB accepted at any of the times
+    double min_psnr;
+};
+
+// Renders every fast mode with the tile kernels of every isa at a few times,
+// from early frames to large phases, and compares them against the double
+// precision reference. The luminance is a sawtooth of the amplitude sum, so
+// pixels on a wrap around can flip between black and white on the smallest
+// error and the max error says little; the bounds are on the PSNR. Fails if
+// a mode falls below its bound.
+static bool
+bench_accuracy(const BenchOptions &opts)
+{
+    // the bounds leave a few dB for smaller images, where a few flipped
+    // pixels weigh more
+    static const AccuracyCase cases[] = {
+        { CosineMode::Table, AmplitudeKernel::Direct, WarpMode::Legacy, 23 },
+        { CosineMode::PolyLow, AmplitudeKernel::Direct, WarpMode::Legacy, 35 },
+        { CosineMode::PolyMedium,
+          AmplitudeKernel::Direct,
+          WarpMode::Legacy,
+          40 },
+        { CosineMode::PolyHigh, AmplitudeKernel::Direct, WarpMode::Legacy, 40 },
+        { CosineMode::Quarter, AmplitudeKernel::Direct, WarpMode::Legacy, 38 },
+        { CosineMode::Quarter16,
+          AmplitudeKernel::Direct,
+          WarpMode::Legacy,
+          38 },
+        { CosineMode::PolyHigh,
+          AmplitudeKernel::Recurrence,
+          WarpMode::Legacy,
+          40 },
+        { CosineMode::PolyHigh,
+          AmplitudeKernel::Separable,
+          WarpMode::Legacy,
+          43 },
+        { CosineMode::PolyHigh, AmplitudeKernel::Direct, WarpMode::Radial, 38 },
+        { CosineMode::PolyHigh,
+          AmplitudeKernel::Direct,
+          WarpMode::Anisotropic,
+          38 },
+    };
+    static const float times[] = { 0.1f, 2.5f, 40, 1000 };
+
+    Config conf;
+    conf.img_w = opts.img_w;
+    conf.img_h = opts.img_h;
+    conf.tile_w = opts.tile_w;
+    conf.tile_h = opts.tile_h;
+
+    Image img;
+    img.init(opts.img_w, opts.img_h);
+    TileGrid grid;
+    grid.init(opts.img_w, opts.img_h, opts.tile_w, opts.tile_h);
+    Transforms trafos;
+    trafos.init(opts.img_w, opts.img_h);
+    Uniforms uniforms;
+    uniforms.init(conf.nwaves, conf.ncosines);
+
+    printf("accuracy: %ux%u, %u waves, against a double precision reference "
+           "at times",
+           unsigned(img.w),
+           unsigned(img.h),
+           unsigned(conf.nwaves));
+    for (float t : times)
+        printf(" %g", double(t));
+    printf(", worst of them\n");
+    printf("%-7s %-11s %-10s %-11s %8s %8s %8s %8s\n",
+           "isa",
+           "cosine",
+           "amplitude",
+           "warp",
+           "psnr dB",
+           "bound",
+           "max err",
+           ">1 %");
+
+    // the references only depend on the warp and the time
+    const size_t nwarps = size_t(WarpMode::Anisotropic) + 1;
+    std::vector<std::vector<uint8_t>> references[nwarps];
+
+    bool ok = true;
+    for (KernelIsa isa :
+         { KernelIsa::SSE2, KernelIsa::AVX2, KernelIsa::AVX512 }) {
+        const RenderKernels *kernels = select_render_kernels(isa);
+        if (!kernels)
+            continue;
+
+        for (const AccuracyCase &c : cases) {
+            conf.cosine = c.cosine;
+            conf.amplitudes = c.amplitudes;
+            conf.warp = c.warp;
+
+            std::vector<float> waves;
+            KernelArgs args = make_kernel_args(conf, uniforms, trafos, waves);
+
+            PixelCache wave_sums;
+            if (c.amplitudes == AmplitudeKernel::Separable) {
+                PixelCache::Key key;
+                key.grid = grid;
+                wave_sums.update(key);
+                for (uint32_t i = 0; i < grid.ntiles(); ++i)
+                    kernels->wave_sums_tile(
+                      args, grid.rect(i), wave_sums.data.get());
+                args.wave_sums = wave_sums.data.get();
+            }
+
+            auto &refs = references[size_t(c.warp)];
+            ImageError worst = { INFINITY, 0, 0 };
+            for (size_t k = 0; k < std::size(times); ++k) {
+                args.time = times[k];
+                if (refs.size() <= k) {
+                    refs.emplace_back();
+                    render_reference(args, img.w, img.h, refs.back());
+                }
+
+                for (uint32_t i = 0; i < grid.ntiles(); ++i)
+                    kernels->draw_tile(
+                      args, grid.rect(i), img.stride, img.data());
+
+                ImageError err = compare_images(refs[k], img);
+                worst.psnr = std::min(worst.psnr, err.psnr);
+                worst.max = std::max(worst.max, err.max);
+                worst.off_by_more_than_one = std::max(
+                  worst.off_by_more_than_one, err.off_by_more_than_one);
+            }
+
+            const bool pass = worst.psnr >= c.min_psnr;
+            ok = ok && pass;
+            printf("%-7s %-11s %-10s %-11s %8.2f %8.2f %8u %8.3f%s\n",
+                   kernels->isa,
+                   Config::cosine_name(c.cosine),
+                   Config::amplitudes_name(c.amplitudes),
+                   Config::warp_name(c.warp),
+                   worst.psnr,
+                   c.min_psnr,
+                   unsigned(worst.max),
+                   worst.off_by_more_than_one * 100,
+                   pass ? "" : "  FAIL");
+        }
+    }
+
+    if (!ok)
+        fprintf(stderr, "accuracy: modes below their bound\n");
+    return ok;
+}
+
+struct Benchmark
+{
+    const char *name;
+    bool (*run)(const BenchOptions &);
+};
+
+static const Benchmark BENCHMARKS[] = {
+    { "fused", bench_fused },
+    { "stages", bench_stages },
+    { "sched", bench_sched },
+    { "bmp", bench_bmp },
+    { "accuracy", bench_accuracy },
+};
+
+static void
+print_usage()
+{
+    fprintf(stderr,
+            "crystal_bench [OPTION]... [BENCHMARK]...\n"
+            "  -s WxH  image size, default 1920x1080\n"
+            "  -t WxH  tile size, default 64x64\n"
+            "  -r N    repetitions, the best one is reported, default 5\n"
+            "  -j N    largest number of threads, default: all cpus\n"
+            "BENCHMARKS (all by default):\n");
+    for (const Benchmark &b : BENCHMARKS)
+        fprintf(stderr, "  %s\n", b.name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    BenchOptions opts;
+    std::vector<const Benchmark *> selected;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-s") == 0 && i + 1 < argc) {
+            unsigned w, h;
+            if (sscanf(argv[++i], "%ux%u", &w, &h) != 2 || w == 0 ||
+                h == 0) {
+                fprintf(stderr, "invalid image size: %s\n", argv[i]);
+                return 1;
+            }
+            opts.img_w = w;
+            opts.img_h = h;
+        } else if (strcmp(arg, "-t") == 0 && i + 1 < argc) {
+            unsigned w, h;
+            if (sscanf(argv[++i], "%ux%u", &w, &h) != 2 || w == 0 ||
+                h == 0 || w % TILE_ALIGN != 0 || w * h > MAX_TILE_PIXELS) {
+                fprintf(stderr, "invalid tile size: %s\n", argv[i]);
+                return 1;
+            }
+            opts.tile_w = w;
+            opts.tile_h = h;
+        } else if (strcmp(arg, "-r") == 0 && i + 1 < argc) {
+            opts.reps = uint32_t(atoi(argv[++i]));
+            if (opts.reps < 1) {
+                fprintf(stderr, "invalid repetitions: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(arg, "-j") == 0 && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 1 || n > 256) {
+                fprintf(stderr, "invalid number of threads: %s\n", argv[i]);
+                return 1;
+            }
+            opts.max_threads = uint32_t(n);
+        } else {
+            const Benchmark *found = nullptr;
+            for (const Benchmark &b : BENCHMARKS)
+                if (strcmp(arg, b.name) == 0)
+                    found = &b;
+            if (!found) {
+                print_usage();
+                return 1;
+            }
+            selected.push_back(found);
+        }
+    }
+
+    if (selected.empty())
+        for (const Benchmark &b : BENCHMARKS)
+            selected.push_back(&b);
+
+    bool ok = true;
+    for (const Benchmark *b : selected)
+        ok = b->run(opts) && ok;
+
+    return ok ? 0 : 1;
+}
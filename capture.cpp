@@ -0,0 +1,314 @@
+#include "capture.hpp"
+
+#include "BMP.hpp"
+#include "GIF.hpp"
+#include "utils.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+bool
+save_capture(const std::string &path,
+             const Image &img,
+             CaptureFormat format,
+             size_t *nbytes)
+{
+    const uint32_t bpp = format == CaptureFormat::Bmp8 ? 8 : 24;
+    if (nbytes)
+        *nbytes = bmp_file_size(img.w, img.h, bpp);
+    return write_bmp_file(
+      path.c_str(), img.w, img.h, img.stride, img.data(), bpp);
+}
+
+// encodes img as a raw gray frame or a y4m frame (4:2:0 with constant
+// chroma), the last row of img comes first so that the stream shows the
+// frames the way the bmp captures do
+static void
+encode_gray(const Image &img, bool y4m, std::vector<uint8_t> &buf)
+{
+    static const char FRAME[] = "FRAME\n";
+    const size_t header = y4m ? sizeof FRAME - 1 : 0;
+    const size_t luma = size_t(img.w) * img.h;
+    const size_t chroma =
+      y4m ? 2 * size_t(CEIL_DIV(img.w, 2)) * CEIL_DIV(img.h, 2) : 0;
+
+    buf.resize(header + luma + chroma);
+    memcpy(buf.data(), FRAME, header);
+
+    uint8_t *out = buf.data() + header;
+    for (uint32_t y = 0; y < img.h; ++y) {
+        memcpy(out, &img(0, img.h - 1 - y), img.w);
+        out += img.w;
+    }
+    memset(out, 128, chroma);
+}
+
+static bool
+write_all(int fd, const void *data, size_t size)
+{
+    auto p = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+CaptureWriter::CaptureWriter(const Config &conf, int stream_fd)
+  : _capacity(std::max(conf.nframes - 1, 1u))
+  , _format(conf.capture_format)
+  , _policy(conf.capture_policy)
+  , _fps(conf.fps)
+  , _first_frame(conf.first_frame)
+  , _stream_fd(stream_fd)
+{
+    for (uint32_t i = 0; i < conf.nwriters; ++i)
+        _threads.emplace_back(&CaptureWriter::run, this);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    finish();
+}
+
+bool
+CaptureWriter::submit(std::string path,
+                      const Image &img,
+                      std::function<void()> done)
+{
+    Job job;
+    {
+        std::unique_lock lk(_mutex);
+
+        if (Config::format_is_stream(_format)) {
+            if (_next_seq == 0) {
+                _stream_w = img.w;
+                _stream_h = img.h;
+            } else if (img.w != _stream_w || img.h != _stream_h) {
+                fprintf(stderr,
+                        "Frame size changed to %ux%u, not written to the "
+                        "stream\n",
+                        unsigned(img.w),
+                        unsigned(img.h));
+                ++_stats.failed;
+                lk.unlock();
+                done();
+                return false;
+            }
+        }
+
+        auto full = [this] { return _queue.size() + _in_flight >= _capacity; };
+        if (!_threads.empty() && full()) {
+            if (_policy == CapturePolicy::Drop) {
+                ++_stats.dropped;
+                lk.unlock();
+                done();
+                return false;
+            }
+            StopWatch watch;
+            watch.start();
+            _not_full.wait(lk, [&] { return !full(); });
+            _stats.blocked += watch.now();
+        }
+
+        job = { std::move(path), &img, std::move(done), _next_seq++ };
+        if (!_threads.empty()) {
+            _queue.push_back(std::move(job));
+            _stats.max_depth = std::max(
+              _stats.max_depth, uint32_t(_queue.size() + _in_flight));
+        }
+    }
+
+    if (_threads.empty()) {
+        write(job, _buf);
+    } else {
+        _not_empty.notify_one();
+    }
+    return true;
+}
+
+void
+CaptureWriter::run()
+{
+    // the encoded frame of a stream format, kept for the next one
+    std::vector<uint8_t> buf;
+
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock lk(_mutex);
+            _not_empty.wait(lk, [this] { return !_queue.empty() || _stopping; });
+            if (_queue.empty())
+                return;
+            job = std::move(_queue.front());
+            _queue.pop_front();
+            ++_in_flight;
+        }
+
+        write(job, buf);
+
+        {
+            std::lock_guard lk(_mutex);
+            --_in_flight;
+        }
+        _not_full.notify_one();
+    }
+}
+
+void
+CaptureWriter::write(Job &job, std::vector<uint8_t> &buf)
+{
+    size_t bytes = 0;
+    bool ok;
+    if (_format == CaptureFormat::Gif) {
+        // bottom up like the other stream formats
+        const Image &img = *job.img;
+        buf.clear();
+        gif_append_frame(buf,
+                         &img(0, img.h - 1),
+                         -ptrdiff_t(img.stride),
+                         img.w,
+                         img.h,
+                         gif_delay());
+        job.done();
+        bytes = buf.size();
+        ok = write_stream(job.seq, buf);
+    } else if (Config::format_is_stream(_format)) {
+        encode_gray(*job.img, _format == CaptureFormat::Y4m, buf);
+        // the frame can be reused while waiting for our turn
+        job.done();
+        bytes = buf.size();
+        ok = write_stream(job.seq, buf);
+    } else {
+        ok = save_capture(job.path, *job.img, _format, &bytes);
+        if (!ok)
+            fprintf(stderr, "Failed to write file %s\n", job.path.c_str());
+        job.done();
+    }
+
+    std::lock_guard lk(_mutex);
+    if (ok) {
+        ++_stats.written;
+        _stats.bytes += double(bytes);
+    } else {
+        ++_stats.failed;
+    }
+}
+
+bool
+CaptureWriter::write_stream(uint64_t seq, const std::vector<uint8_t> &buf)
+{
+    std::unique_lock lk(_mutex);
+    _stream_turn.wait(lk, [&] { return _next_write == seq; });
+    bool ok = !_broken;
+    lk.unlock();
+
+    int err = 0;
+    if (ok && seq == 0 && _first_frame == 0) {
+        std::vector<uint8_t> header = stream_header();
+        ok = write_all(_stream_fd, header.data(), header.size());
+    }
+    if (ok)
+        ok = write_all(_stream_fd, buf.data(), buf.size());
+    if (!ok)
+        err = errno;
+
+    lk.lock();
+    if (!ok && !_broken) {
+        _broken = true;
+        if (err != 0)
+            fprintf(stderr,
+                    "Failed to write the capture stream: %s\n",
+                    strerror(err));
+    }
+    ++_next_write;
+    lk.unlock();
+    _stream_turn.notify_all();
+    return ok;
+}
+
+std::vector<uint8_t>
+CaptureWriter::stream_header() const
+{
+    std::vector<uint8_t> header;
+    if (_format == CaptureFormat::Y4m) {
+        char line[128];
+        int n = snprintf(line,
+                         sizeof line,
+                         "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg "
+                         "XCOLORRANGE=FULL\n",
+                         unsigned(_stream_w),
+                         unsigned(_stream_h),
+                         unsigned(_fps));
+        header.assign(line, line + n);
+    } else if (_format == CaptureFormat::Gif) {
+        gif_append_header(header, _stream_w, _stream_h);
+    }
+    return header;
+}
+
+// in 1/100 seconds, browsers show shorter delays as 1/10 seconds
+uint16_t
+CaptureWriter::gif_delay() const
+{
+    return uint16_t(std::max(2L, std::lround(100.0 / _fps)));
+}
+
+void
+CaptureWriter::finish()
+{
+    {
+        std::lock_guard lk(_mutex);
+        if (_stopping)
+            return;
+        _stopping = true;
+    }
+    _not_empty.notify_all();
+    // the threads drain the queue before they see _stopping
+    for (auto &t : _threads)
+        t.join();
+    _threads.clear();
+
+    if (_format == CaptureFormat::Gif && _next_write > 0 && !_broken &&
+        !write_all(_stream_fd, &GIF_TRAILER, 1)) {
+        _broken = true;
+        fprintf(stderr,
+                "Failed to write the capture stream: %s\n",
+                strerror(errno));
+    }
+}
+
+bool
+CaptureWriter::broken()
+{
+    std::lock_guard lk(_mutex);
+    return _broken;
+}
+
+uint32_t
+CaptureWriter::depth()
+{
+    std::lock_guard lk(_mutex);
+    return uint32_t(_queue.size()) + _in_flight;
+}
+
+CaptureWriter::Stats
+CaptureWriter::take_stats()
+{
+    std::lock_guard lk(_mutex);
+    Stats s = _stats;
+    _stats = Stats();
+    _stats.max_depth = uint32_t(_queue.size()) + _in_flight;
+    return s;
+}
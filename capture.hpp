@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Config.hpp"
+#include "render.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// writes img to path in one of the file formats, the file size is stored in
+// nbytes
+bool
+save_capture(const std::string &path,
+             const Image &img,
+             CaptureFormat format,
+             size_t *nbytes = nullptr);
+
+// Encodes and writes captured frames on a pool of threads, or on the calling
+// thread without any. File formats are written to one file per frame, the
+// stream formats (including the LZW compression of gif frames) are encoded
+// in parallel and written to a single file descriptor in the order the
+// frames were submitted.
+//
+// The jobs refer to the frames of the renderer's ring, which are handed back
+// through the done callback, so a full queue also holds back rendering. When
+// the queue is full submit() either blocks until a writer is done
+// (CapturePolicy::Block) or drops the frame (CapturePolicy::Drop).
+class CaptureWriter
+{
+public:
+    struct Stats
+    {
+        uint32_t written = 0;
+        uint32_t failed = 0;
+        uint32_t dropped = 0;
+        uint32_t max_depth = 0;
+        double bytes = 0;
+        // time submit() spent waiting for room in the queue
+        double blocked = 0;
+    };
+
+    // stream_fd receives the stream formats, it is not closed
+    CaptureWriter(const Config &conf, int stream_fd = -1);
+    ~CaptureWriter();
+
+    // queues img to be written to path (ignored by stream formats), done is
+    // called once img is no longer needed: from a writer thread, right away
+    // if the frame is dropped or before submit() returns without threads.
+    // Returns false if the frame was dropped.
+    bool submit(std::string path,
+                const Image &img,
+                std::function<void()> done);
+
+    // waits until all queued frames are written and stops the threads
+    void finish();
+
+    uint32_t capacity() const { return _capacity; }
+    uint32_t depth();
+
+    // a write to the stream failed (e.g. the reader went away), nothing is
+    // written to it anymore
+    bool broken();
+
+    // statistics since the last call
+    Stats take_stats();
+
+private:
+    struct Job
+    {
+        std::string path;
+        const Image *img;
+        std::function<void()> done;
+        // position in the stream
+        uint64_t seq;
+    };
+
+    void run();
+    void write(Job &job, std::vector<uint8_t> &buf);
+    bool write_stream(uint64_t seq, const std::vector<uint8_t> &buf);
+    std::vector<uint8_t> stream_header() const;
+    uint16_t gif_delay() const;
+
+    const uint32_t _capacity;
+    const CaptureFormat _format;
+    const CapturePolicy _policy;
+    const uint32_t _fps;
+    // a range of frames not starting at 0 continues the stream of another
+    // capture and writes no header
+    const uint32_t _first_frame;
+    const int _stream_fd;
+    std::vector<std::thread> _threads;
+    // the encoding buffer of submit() when there are no threads
+    std::vector<uint8_t> _buf;
+
+    std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+    std::deque<Job> _queue;
+    // jobs taken from the queue but not written yet
+    uint32_t _in_flight = 0;
+    bool _stopping = false;
+    Stats _stats;
+
+    // the stream is written by one thread at a time in submission order
+    std::condition_variable _stream_turn;
+    uint64_t _next_seq = 0;
+    uint64_t _next_write = 0;
+    bool _broken = false;
+    // the frame size given in the y4m header
+    uint32_t _stream_w = 0;
+    uint32_t _stream_h = 0;
+};
@@ -1,12 +1,18 @@
 #include "BMP.hpp"
 #include "Config.hpp"
+#include "capture.hpp"
 #include "euclidean2d.hpp"
 #include "render.hpp"
 #include "simd_vec.hpp"
 #include "utils.hpp"
 
 #include <SDL.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <cassert>
+#include <cerrno>
+#include <csignal>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
@@ -16,6 +22,7 @@
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string>
 #include <vector>
 
 struct Anim
@@ -28,12 +35,20 @@ struct Anim
     uint32_t screenshot_id = 0;
     uint32_t screenshot_max = 0;
 
-    double anim_time = 0;
-
     const Config &conf;
     Renderer renderer;
+    std::unique_ptr<CaptureWriter> writer;
+    // receives the stream capture formats
+    int stream_fd = -1;
+    WorkerStatsLog worker_stats;
 
     SDL_Surface *screen = nullptr;
+    // the luminances of the image in the pixel format of screen
+    Uint32 gray_pixels[256];
+    // the column of the image every column of the window shows, for images
+    // upscale_w pixels wide
+    std::vector<uint32_t> upscale_x;
+    uint32_t upscale_w = 0;
 
     Anim(const Config &conf) : conf(conf), renderer(conf) {}
 
@@ -42,9 +57,10 @@ struct Anim
     bool handle_event(const SDL_Event &);
     bool handle_key_event(const SDL_KeyboardEvent &);
     void animation();
-    void render();
-    void draw();
-    void write_screenshot(uint32_t ser, uint32_t id);
+    bool present(Frame *);
+    void draw(const Image &);
+    void write_screenshot(uint32_t ser, uint32_t id, Frame *);
+    void update_worker_stats();
     bool resize(int, int);
 
     void shutdown();
@@ -69,13 +85,16 @@ Anim::resize(int w, int h)
             print_sdl_error("Opening/Resizing window");
             return false;
         }
+
+        for (uint32_t i = 0; i < 256; ++i)
+            gray_pixels[i] = SDL_MapRGB(screen->format, i, i, i);
     }
 
     return true;
 }
 
 void
-Anim::draw()
+Anim::draw(const Image &img)
 {
     double t0 = 0;
     if (conf.verbose)
@@ -89,27 +108,40 @@ Anim::draw()
 
     assert(screen->format->BytesPerPixel == 4);
 
-    auto const &img = *renderer.srcImage;
-
-    uint32_t w = std::min(win_w, img.w);
-    uint32_t h = std::min(win_h, img.h);
+    // frames rendered at a lower resolution are scaled up to the size given
+    // by -s, nearest neighbour: every row of img is expanded once and copied
+    // to the other rows of the window it covers
+    uint32_t w = std::min(win_w, conf.img_w);
+    uint32_t h = std::min(win_h, conf.img_h);
+    if (upscale_x.size() != w || upscale_w != img.w) {
+        upscale_x.resize(w);
+        for (uint32_t x = 0; x < w; ++x)
+            upscale_x[x] = uint32_t(uint64_t(x) * img.w / conf.img_w);
+        upscale_w = img.w;
+    }
 
     uint32_t stride = screen->pitch / 4;
     Uint32 *dest = (Uint32 *) screen->pixels;
+    const Uint32 *prev = nullptr;
+    uint32_t prev_y = 0;
 
-    if (stride == w) {
-        memcpy(dest, &img(0, 0), w * h * sizeof(RGBA));
-    } else {
-        for (uint32_t y = 0; y < h; ++y) {
-
-            memcpy(dest, &img(0, y), w * sizeof(RGBA));
-            dest += stride;
-
-            // for (uint32_t x = 0; x < w; ++x) {
-            //     put_pixel(screen, x, y,
-            //               map_rgba(screen->format, srcImage(x, y)));
-            // }
+    for (uint32_t y = 0; y < h; ++y) {
+        uint32_t src_y = uint32_t(uint64_t(y) * img.h / conf.img_h);
+        if (prev && src_y == prev_y) {
+            memcpy(dest, prev, w * sizeof *dest);
+        } else {
+            const uint8_t *src = &img(0, src_y);
+            if (img.w == conf.img_w) {
+                for (uint32_t x = 0; x < w; ++x)
+                    dest[x] = gray_pixels[src[x]];
+            } else {
+                for (uint32_t x = 0; x < w; ++x)
+                    dest[x] = gray_pixels[src[upscale_x[x]]];
+            }
+            prev = dest;
+            prev_y = src_y;
         }
+        dest += stride;
     }
 
     if (SDL_MUSTLOCK(screen))
@@ -117,7 +149,7 @@ Anim::draw()
 
     if (conf.verbose) {
         double T = watch.now() - t0;
-        fprintf(stderr, "copying into SDL buffer took %f ms\n", T * 1000);
+        fprintf(stderr, "expanding into SDL buffer took %f ms\n", T * 1000);
     }
 
     if (conf.verbose)
@@ -130,34 +162,32 @@ Anim::draw()
     }
 }
 
+// The writer releases the frame once it is written.
 void
-Anim::write_screenshot(uint32_t ser, uint32_t id)
+Anim::write_screenshot(uint32_t ser, uint32_t id, Frame *frame)
 {
     std::string fn;
-    {
-        int ndigits = int(std::ceil(std::log10(std::max(1u, screenshot_max))));
+    if (!Config::format_is_stream(conf.capture_format)) {
+        // the files of a range are numbered by frame index, with enough
+        // digits for the pieces of a capture to sort together
+        uint32_t last = conf.first_frame + screenshot_max;
+        int ndigits = int(std::ceil(std::log10(std::max(1u, last))));
+        if (conf.frame_range)
+            ndigits = std::max(ndigits, 6);
         std::stringstream fnbuilder;
         fnbuilder << "screenshot_";
         fnbuilder << std::setw(3) << std::setfill('0') << int(ser + 1);
         fnbuilder << "_";
-        fnbuilder << std::setw(ndigits) << std::setfill('0') << int(id);
+        fnbuilder << std::setw(ndigits) << std::setfill('0')
+                  << conf.first_frame + id;
         fnbuilder << ".bmp";
         fn = std::move(fnbuilder).str();
-    }
-    fprintf(stderr, "Writing %s\n", fn.c_str());
-    FILE *out = fopen(fn.c_str(), "wb");
-    bool ok = false;
-    if (out) {
-        const auto &img = *renderer.srcImage;
-        ok = write_bmp(out, img.w, img.h, img.data());
-        if (fclose(out) != 0)
-            ok = false;
+        if (conf.verbose || conf.nwriters == 0)
+            fprintf(stderr, "Writing %s\n", fn.c_str());
     }
 
-    if (!ok) {
-        fprintf(stderr, "Failed to write file %s\n", fn.c_str());
-        return;
-    }
+    writer->submit(
+      std::move(fn), frame->image, [this, frame] { renderer.release(frame); });
 }
 
 bool
@@ -199,14 +229,23 @@ Anim::handle_key_event(const SDL_KeyboardEvent &ev)
     }
 }
 
+// moves the statistics of the frames rendered since the last call into the
+// rolling window and the CSV log
+void
+Anim::update_worker_stats()
+{
+    for (const FrameStats &f : renderer.take_frame_stats())
+        worker_stats.add(f);
+}
+
+// Presents the frames of the render coordinator: the newest one when
+// showing a window, every frame in order when capturing.
 void
 Anim::animation()
 {
     SDL_Event ev;
 
-    const double fps = conf.fps;
-    const double frame_time = 1 / fps;
-    double next_frame;
+    const double frame_time = 1 / double(conf.fps);
     const double draw_stats_cycle = float(1.5);
 
     const double start_time = watch.now();
@@ -225,12 +264,50 @@ Anim::animation()
                     "frame time: %lf sec, fps: %lf\n",
                     frame_time,
                     1 / frame_time);
+            if (conf.verbose && !renderer.is_capture_mode()) {
+                fprintf(stderr,
+                        "skipped %u rendered frames\n",
+                        unsigned(renderer.take_frames_skipped()));
+                fprintf(stderr,
+                        "missed the deadline of %u frames\n",
+                        unsigned(renderer.take_deadlines_missed()));
+            }
+            if (conf.verbose && conf.nworkers > 1) {
+                Renderer::BarrierStats bs = renderer.take_barrier_stats();
+                if (bs.frames > 0)
+                    fprintf(stderr,
+                            "frame barrier: wake avg %.1f us, max %.1f us, "
+                            "done wait %.1f us per frame\n",
+                            bs.wake_sum / bs.frames * 1e6,
+                            bs.wake_max * 1e6,
+                            bs.done_wait_sum / bs.frames * 1e6);
+            }
+            update_worker_stats();
+            if (conf.verbose)
+                worker_stats.print(stderr);
+            CaptureWriter::Stats ws = writer->take_stats();
+            if (screenshot_max > 0 || ws.written > 0) {
+                fprintf(stderr,
+                        "capture: queue depth %u/%u (max %u), %u written, "
+                        "%.1f MB/s, %u dropped, blocked %.1f ms\n",
+                        unsigned(writer->depth()),
+                        unsigned(writer->capacity()),
+                        unsigned(ws.max_depth),
+                        unsigned(ws.written),
+                        ws.bytes / diff * 1e-6,
+                        unsigned(ws.dropped),
+                        ws.blocked * 1e3);
+                if (ws.failed > 0)
+                    fprintf(stderr,
+                            "capture: %u frames failed to write\n",
+                            unsigned(ws.failed));
+            }
             draw_stats_next = real_time + draw_stats_cycle;
             draw_stats_last = real_time;
             num_frames = 0;
         }
 
-        next_frame = real_time + frame_time;
+        Frame *frame;
         if (!renderer.is_capture_mode()) {
             while (SDL_PollEvent(&ev)) {
                 if (!handle_event(ev)) {
@@ -238,28 +315,24 @@ Anim::animation()
                     break;
                 }
             }
+            if (!running)
+                break;
+            // wake up at least once per frame to handle events
+            frame = renderer.acquire_latest(frame_time);
         } else {
-            if (screenshot_id >= screenshot_max) {
+            if (screenshot_id >= screenshot_max || writer->broken()) {
                 running = false;
                 break;
             }
+            frame = renderer.acquire_next();
         }
 
-        if (!running)
-            break;
-
-        anim_time += frame_time;
-        renderer.uniforms.time = anim_time * conf.time_speed + conf.time_t0;
-        renderer.trafos.rotation =
-          AffineTrafo2::rotation(renderer.uniforms.rot_omega * anim_time);
+        if (!frame)
+            continue;
 
-        render();
+        if (!present(frame))
+            renderer.release(frame);
         ++num_frames;
-
-        if (!running)
-            break;
-
-        sleep(next_frame - watch.now());
     }
 }
 
@@ -270,18 +343,6 @@ shutdown_sdl(void)
     SDL_Quit();
 }
 
-void
-Transforms::init(uint32_t w, uint32_t h)
-{
-    float scale = float(150);
-
-    float invX = scale / float(w);
-    float invY = scale / float(h);
-    inverseWorld.x = vec2{ invX, 0 };
-    inverseWorld.y = vec2{ 0, invY };
-    inverseWorld.origin = point2{ -0.5f * scale * vec2{ 1, 1 } };
-}
-
 bool
 Anim::init()
 {
@@ -291,18 +352,44 @@ Anim::init()
     if (conf.ncapture > 0)
         screenshot_max = conf.ncapture;
 
+    if (Config::format_is_stream(conf.capture_format)) {
+        if (conf.capture_output == "-") {
+            stream_fd = STDOUT_FILENO;
+        } else {
+            stream_fd = open(conf.capture_output.c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                             0666);
+            if (stream_fd < 0) {
+                fprintf(stderr,
+                        "Failed to open %s: %s\n",
+                        conf.capture_output.c_str(),
+                        strerror(errno));
+                return false;
+            }
+        }
+        // a reader going away is reported by write()
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    writer = std::make_unique<CaptureWriter>(conf, stream_fd);
+
+    if (!conf.stats_log.empty() && !worker_stats.open_csv(conf.stats_log))
+        return false;
+
     return resize(conf.img_w, conf.img_h);
 }
 
-void
-Anim::render()
+// Returns true if the frame is released by the capture writer.
+bool
+Anim::present(Frame *frame)
 {
-    renderer.render();
     if (!renderer.is_capture_mode())
-        draw();
+        draw(frame->image);
 
+    bool handed_off = false;
     if (screenshot_id < screenshot_max) {
-        write_screenshot(screenshot_ser, screenshot_id);
+        write_screenshot(screenshot_ser, screenshot_id, frame);
+        handed_off = true;
         screenshot_id++;
         if (screenshot_id >= screenshot_max) {
             screenshot_id = 0;
@@ -310,6 +397,161 @@ Anim::render()
             screenshot_ser++;
         }
     }
+    return handed_off;
+}
+
+// the model name of the first cpu in /proc/cpuinfo
+static std::string
+cpu_model()
+{
+    std::string model = "unknown";
+    if (FILE *in = fopen("/proc/cpuinfo", "r")) {
+        char line[512];
+        while (fgets(line, sizeof line, in)) {
+            const char *colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) == 0 && colon) {
+                model = colon + 1;
+                model.erase(0, model.find_first_not_of(" \t"));
+                model.erase(model.find_last_not_of(" \t\n") + 1);
+                break;
+            }
+        }
+        fclose(in);
+    }
+    return model;
+}
+
+// a JSON string literal, cpu model names need no more than this
+static std::string
+json_string(const std::string &s)
+{
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (uint8_t(c) >= 0x20)
+            out += c;
+    }
+    return out + "\"";
+}
+
+// frames whose stages are timed after the benchmark, on a single thread
+const uint32_t PROFILE_FRAMES = 8;
+
+// -B: renders conf.nbench frames as fast as the renderer can, without SDL,
+// pacing or captures. The frame times are measured by the coordinator, the
+// stage breakdown comes from rendering the first frames once more with the
+// staged kernel.
+static int
+run_benchmark(const Config &conf)
+{
+    WorkerStatsLog worker_stats;
+    if (!conf.stats_log.empty() && !worker_stats.open_csv(conf.stats_log))
+        return 1;
+
+    Renderer renderer(conf);
+    if (!renderer.init())
+        return 1;
+
+    std::vector<double> times;
+    times.reserve(conf.nbench);
+    while (times.size() < conf.nbench) {
+        Frame *frame = renderer.acquire_next();
+        if (!frame)
+            break;
+        times.push_back(frame->render_time);
+        renderer.release(frame);
+        for (const FrameStats &f : renderer.take_frame_stats())
+            worker_stats.add(f);
+    }
+    renderer.shutdown();
+    for (const FrameStats &f : renderer.take_frame_stats())
+        worker_stats.add(f);
+
+    const uint32_t nframes = uint32_t(times.size());
+    const Renderer::StageProfile stages =
+      renderer.profile_stages(std::min(nframes, PROFILE_FRAMES));
+
+    double total = 0;
+    for (double t : times)
+        total += t;
+    const double npixels = double(conf.img_w) * conf.img_h;
+    const double mpixels = total > 0 ? nframes * npixels / total * 1e-6 : 0;
+    const double mean = nframes > 0 ? total / nframes : 0;
+    const double p50 = percentile(times, 0.5);
+    const double p99 = percentile(times, 0.99);
+    const double max = percentile(times, 1);
+    double stage_sum = 0;
+    for (double t : stages.seconds)
+        stage_sum += t;
+
+    fprintf(stderr,
+            "benchmark: %u frames of %ux%u, %s kernels, %u workers\n",
+            unsigned(nframes),
+            unsigned(conf.img_w),
+            unsigned(conf.img_h),
+            renderer.kernels->isa,
+            unsigned(conf.nworkers));
+    fprintf(stderr,
+            "  throughput: %.1f Mpixels/s, %.1f fps\n",
+            mpixels,
+            mean > 0 ? 1 / mean : 0);
+    fprintf(stderr,
+            "  frame time: mean %.2f ms, p50 %.2f ms, p99 %.2f ms, "
+            "max %.2f ms\n",
+            mean * 1e3,
+            p50 * 1e3,
+            p99 * 1e3,
+            max * 1e3);
+    fprintf(stderr,
+            "  stages (staged kernel on one thread, %u frames):\n",
+            unsigned(stages.frames));
+    for (uint32_t s = 0; s < NUM_RENDER_STAGES; ++s)
+        fprintf(stderr,
+                "    %-11s %8.2f ms %7.2f ns/pixel %5.1f %%\n",
+                render_stage_name(RenderStage(s)),
+                stages.seconds[s] * 1e3,
+                stages.seconds[s] / npixels * 1e9,
+                stage_sum > 0 ? stages.seconds[s] / stage_sum * 100 : 0);
+
+    worker_stats.print(stderr);
+
+    printf("{\n");
+    printf("  \"frames\": %u,\n", unsigned(nframes));
+    printf("  \"width\": %u,\n", unsigned(conf.img_w));
+    printf("  \"height\": %u,\n", unsigned(conf.img_h));
+    printf("  \"cpu\": %s,\n", json_string(cpu_model()).c_str());
+    printf("  \"isa\": \"%s\",\n", renderer.kernels->isa);
+    printf("  \"workers\": %u,\n", unsigned(conf.nworkers));
+    printf("  \"waves\": %u,\n", unsigned(conf.nwaves));
+    printf("  \"cosine\": \"%s\",\n", Config::cosine_name(conf.cosine));
+    printf("  \"warp\": \"%s\",\n", Config::warp_name(conf.warp));
+    printf("  \"amplitudes\": \"%s\",\n",
+           Config::amplitudes_name(conf.amplitudes));
+    printf("  \"sched\": \"%s\",\n", Config::sched_name(conf.sched));
+    printf("  \"affinity\": \"%s\",\n",
+           Config::affinity_name(conf.affinity));
+    printf("  \"tile\": \"%ux%u\",\n",
+           unsigned(conf.tile_w),
+           unsigned(conf.tile_h));
+    printf("  \"mpixels_per_second\": %.3f,\n", mpixels);
+    printf("  \"frame_ms\": { \"mean\": %.4f, \"p50\": %.4f, "
+           "\"p99\": %.4f, \"max\": %.4f },\n",
+           mean * 1e3,
+           p50 * 1e3,
+           p99 * 1e3,
+           max * 1e3);
+    printf("  \"stage_frames\": %u,\n", unsigned(stages.frames));
+    printf("  \"stage_ms\": {");
+    for (uint32_t s = 0; s < NUM_RENDER_STAGES; ++s)
+        printf("%s \"%s\": %.4f",
+               s > 0 ? "," : "",
+               render_stage_name(RenderStage(s)),
+               stages.seconds[s] * 1e3);
+    printf(" }\n");
+    printf("}\n");
+
+    return nframes == conf.nbench ? 0 : 1;
 }
 
 int
@@ -324,12 +566,32 @@ main(int argc, char *argv[])
     }
 
     const auto &conf = *opt_conf;
-    printf("Config:\n");
-    printf("  verbose:    %s\n", conf.verbose ? "true" : "false");
-    printf("  nwaves:     %u\n", unsigned(conf.nwaves));
-    printf("  nworkers:   %u\n", unsigned(conf.nworkers));
-    printf("  fps:        %u\n", unsigned(conf.fps));
-    printf("  image size: %ux%u\n", unsigned(conf.img_w), unsigned(conf.img_h));
+    // stdout is kept free for the stream capture formats
+    fprintf(stderr, "Config:\n");
+    fprintf(stderr, "  verbose:    %s\n", conf.verbose ? "true" : "false");
+    fprintf(stderr, "  nwaves:     %u\n", unsigned(conf.nwaves));
+    fprintf(stderr, "  nworkers:   %u\n", unsigned(conf.nworkers));
+    fprintf(stderr, "  fps:        %u\n", unsigned(conf.fps));
+    if (conf.ncapture == 0 && conf.nbench == 0)
+        fprintf(stderr, "  min scale:  %u%%\n", unsigned(conf.min_scale));
+    fprintf(stderr, "  ring depth: %u\n", unsigned(conf.nframes));
+    fprintf(stderr,
+            "  capture:    %s, %u writers (%s)\n",
+            Config::capture_format_name(conf.capture_format),
+            unsigned(conf.nwriters),
+            Config::capture_policy_name(conf.capture_policy));
+    if (conf.frame_range)
+        fprintf(stderr,
+                "  frames:     %u to %u\n",
+                unsigned(conf.first_frame),
+                unsigned(conf.first_frame + conf.ncapture - 1));
+    fprintf(stderr,
+            "  image size: %ux%u\n",
+            unsigned(conf.img_w),
+            unsigned(conf.img_h));
+
+    if (conf.nbench > 0)
+        return run_benchmark(conf);
 
     if (SDL_Init(
           conf.ncapture > 0 ? 0 : SDL_INIT_VIDEO | SDL_INIT_EVENTTHREAD) != 0) {
@@ -344,13 +606,20 @@ main(int argc, char *argv[])
         return 1;
 
     anim.animation();
+    bool stream_ok = !anim.writer->broken();
     anim.shutdown();
 
-    return 0;
+    return stream_ok ? 0 : 1;
 }
 
 void
 Anim::shutdown()
 {
+    // the writers hold frames of the ring
+    if (writer)
+        writer->finish();
+    if (stream_fd >= 0 && stream_fd != STDOUT_FILENO)
+        close(stream_fd);
     renderer.shutdown();
+    update_worker_stats();
 }
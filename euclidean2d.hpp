@@ -10,6 +10,7 @@ struct vec2
     vec2 operator-() const { return { -x, -y }; }
     vec2 operator-(vec2 b) const { return *this + (-b); }
     vec2 operator*(float s) const { return { x * s, y * s }; }
+    bool operator==(vec2 b) const { return x == b.x && y == b.y; }
 };
 
 inline vec2 operator*(float s, const vec2 &v)
@@ -17,6 +18,12 @@ inline vec2 operator*(float s, const vec2 &v)
     return v * s;
 }
 
+inline float
+dot(const vec2 &a, const vec2 &b)
+{
+    return a.x * b.x + a.y * b.y;
+}
+
 struct point2
 {
     vec2 coords;
@@ -26,6 +33,7 @@ struct point2
 
     vec2 operator-(const point2 &q) const { return coords - q.coords; }
     point2 operator+(const vec2 &v) const { return point2(coords + v); }
+    bool operator==(const point2 &q) const { return coords == q.coords; }
 };
 
 inline point2
@@ -62,6 +70,13 @@ struct AffineTrafo2
 
         return { x, y };
     }
+
+    bool operator==(const AffineTrafo2 &U) const
+    {
+        return x == U.x && y == U.y && origin == U.origin;
+    }
+
+    bool operator!=(const AffineTrafo2 &U) const { return !(*this == U); }
 };
 
 inline AffineTrafo2 operator*(const AffineTrafo2 &T, const AffineTrafo2 &U)
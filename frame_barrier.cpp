@@ -0,0 +1,132 @@
+#include "frame_barrier.hpp"
+
+#include "utils.hpp"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+// iterations of the spin loop before parking, a few microseconds
+const uint32_t SPIN_LIMIT = 1 << 11;
+
+static void
+futex_wait(std::atomic<uint32_t> &word, uint32_t expected)
+{
+    syscall(SYS_futex,
+            reinterpret_cast<uint32_t *>(&word),
+            FUTEX_WAIT_PRIVATE,
+            expected,
+            nullptr,
+            nullptr,
+            0);
+}
+
+static void
+futex_wake_all(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex,
+            reinterpret_cast<uint32_t *>(&word),
+            FUTEX_WAKE_PRIVATE,
+            INT32_MAX,
+            nullptr,
+            nullptr,
+            0);
+}
+
+// Waits until word != value. The parked counter is raised before the final
+// check in futex_wait, the waking side changes word before it reads the
+// counter (both sequentially consistent), so either the waker sees the
+// counter or futex_wait sees the new value.
+static void
+wait_while_equal(std::atomic<uint32_t> &word,
+                 uint32_t value,
+                 std::atomic<uint32_t> &parked)
+{
+    for (uint32_t i = 0; i < SPIN_LIMIT; ++i) {
+        if (word.load(std::memory_order_acquire) != value)
+            return;
+        _mm_pause();
+    }
+
+    while (word.load(std::memory_order_seq_cst) == value) {
+        parked.fetch_add(1, std::memory_order_seq_cst);
+        futex_wait(word, value);
+        parked.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+FrameBarrier::FrameBarrier(uint32_t nworkers, bool collect_stats)
+  : _nworkers(nworkers)
+  , _collect_stats(collect_stats)
+  , _generation(0)
+  , _parked_workers(0)
+  , _start_ns(0)
+  , _pending(0)
+  , _coordinator_parked(0)
+  , _wake_sum_ns(0)
+  , _wake_max_ns(0)
+{}
+
+void
+FrameBarrier::start_frame()
+{
+    _pending.store(_nworkers, std::memory_order_relaxed);
+    if (_collect_stats) {
+        _wake_sum_ns.store(0, std::memory_order_relaxed);
+        _wake_max_ns.store(0, std::memory_order_relaxed);
+        _start_ns.store(now_ns(), std::memory_order_relaxed);
+    }
+
+    _generation.fetch_add(1, std::memory_order_seq_cst);
+    if (_parked_workers.load(std::memory_order_seq_cst) > 0)
+        futex_wake_all(_generation);
+}
+
+void
+FrameBarrier::wait_frame_done()
+{
+    uint32_t pending;
+    while ((pending = _pending.load(std::memory_order_acquire)) != 0)
+        wait_while_equal(_pending, pending, _coordinator_parked);
+}
+
+uint32_t
+FrameBarrier::wait_frame_start(uint32_t seen)
+{
+    wait_while_equal(_generation, seen, _parked_workers);
+
+    if (_collect_stats) {
+        uint64_t wake =
+          now_ns() - _start_ns.load(std::memory_order_relaxed);
+        _wake_sum_ns.fetch_add(wake, std::memory_order_relaxed);
+        uint64_t max = _wake_max_ns.load(std::memory_order_relaxed);
+        while (wake > max && !_wake_max_ns.compare_exchange_weak(
+                               max, wake, std::memory_order_relaxed))
+            ;
+    }
+
+    return _generation.load(std::memory_order_acquire);
+}
+
+void
+FrameBarrier::frame_done()
+{
+    if (_pending.fetch_sub(1, std::memory_order_seq_cst) != 1)
+        return;
+    if (_coordinator_parked.load(std::memory_order_seq_cst) > 0)
+        futex_wake_all(_pending);
+}
+
+FrameBarrier::Stats
+FrameBarrier::stats() const
+{
+    Stats s = { 0, 0 };
+    if (_nworkers > 0) {
+        s.wake_avg = double(_wake_sum_ns.load(std::memory_order_relaxed)) *
+                     1e-9 / _nworkers;
+        s.wake_max = double(_wake_max_ns.load(std::memory_order_relaxed)) *
+                     1e-9;
+    }
+    return s;
+}
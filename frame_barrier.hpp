@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Starts and ends the frames of a fixed group of workers with one broadcast
+// each way. The coordinator starts a frame by bumping the generation, which
+// releases all workers at once; workers count down a single arrival counter
+// when done and the last one wakes the coordinator. Waiting spins for a
+// short while and then parks on a futex, wake ups are only issued when
+// somebody is parked.
+class FrameBarrier
+{
+public:
+    struct Stats
+    {
+        // time from start_frame() until the workers noticed, in seconds
+        double wake_avg;
+        double wake_max;
+    };
+
+    // nworkers: number of workers, not counting the coordinator
+    explicit FrameBarrier(uint32_t nworkers, bool collect_stats = false);
+
+    // coordinator: releases the workers into a new frame
+    void start_frame();
+
+    // coordinator: blocks until every worker called frame_done()
+    void wait_frame_done();
+
+    // worker: blocks until a frame after generation seen starts, returns
+    // the generation of that frame
+    uint32_t wait_frame_start(uint32_t seen);
+
+    // worker: done with the current frame
+    void frame_done();
+
+    // wake up latencies of the last frame, valid after wait_frame_done()
+    Stats stats() const;
+
+private:
+    const uint32_t _nworkers;
+    const bool _collect_stats;
+
+    alignas(64) std::atomic<uint32_t> _generation;
+    std::atomic<uint32_t> _parked_workers;
+    std::atomic<uint64_t> _start_ns;
+
+    alignas(64) std::atomic<uint32_t> _pending;
+    std::atomic<uint32_t> _coordinator_parked;
+    std::atomic<uint64_t> _wake_sum_ns;
+    std::atomic<uint64_t> _wake_max_ns;
+};
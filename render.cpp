@@ -1,27 +1,18 @@
 #include "render.hpp"
 
 #include "euclidean2d.hpp"
-#include "simd_vec.hpp"
+#include "topology.hpp"
 #include "utils.hpp"
 
+#include <x86intrin.h>
+
 #include <algorithm>
 #include <cassert>
 #include <cmath>
-#include <condition_variable>
+#include <cstring>
+#include <iterator>
 #include <mutex>
 
-const uint32_t TILE_SIZE = CEIL_DIV(4 * 4096, sizeof(RGBA));
-
-struct Barrier
-{
-    std::mutex mutex;
-    std::condition_variable condition;
-    bool open = false;
-
-    void wait();
-    void notify();
-};
-
 struct Worker
 {
 
@@ -39,18 +30,21 @@ struct Worker
     const int id;
     Renderer &renderer;
     std::thread thread;
-    Barrier start_frame_barrier;
-    Barrier done_frame_barrier;
     volatile bool shutdown = false;
+    // generation of the last frame barrier passed
+    uint32_t frame = 0;
+    // steady clock time stamps of the current frame: when the worker started
+    // on it and when it ran out of tiles
+    uint64_t wake_ns = 0;
+    uint64_t done_ns = 0;
 
     Image *image = nullptr;
     uint64_t version = 0;
 
     std::mutex mutex;
 
-    volatile int done_flag;
-
-    std::queue<Rect> jobs;
+    // wave vectors rotated for the current frame
+    std::vector<float> waves;
 
     Worker(const Config &conf, Renderer &renderer, int id)
       : conf(conf), id(id), renderer(renderer)
@@ -62,8 +56,6 @@ struct Worker
 
     bool is_coordinator() const { return id == 0; }
 
-    bool get_work(Rect &rect);
-
     static int run_thread(void *);
 
     void run();
@@ -99,474 +91,720 @@ Worker::wait_shutdown()
     return true;
 }
 
-template<typename T>
-bool
-queue_get(std::queue<T> &q, T &res)
+void
+Worker::render_rects()
 {
-    if (q.empty())
-        return false;
-    res = q.front();
-    q.pop();
-    return true;
+    if (!is_coordinator())
+        frame = renderer.frame_barrier->wait_frame_start(frame);
+
+    if (shutdown)
+        return;
+
+    wake_ns = now_ns();
+    image = renderer.target;
+    ++version;
+
+    const KernelArgs args = renderer.kernel_args(waves);
+    const auto draw_tile = renderer.kernels->draw_tile;
+
+    TileScheduler &scheduler = *renderer.scheduler;
+    uint32_t tile;
+    while (scheduler.next_tile(id, tile))
+        draw_tile(args, renderer.grid.rect(tile), image->stride, image->data());
+    done_ns = now_ns();
+
+    if (!is_coordinator())
+        renderer.frame_barrier->frame_done();
 }
 
-static void
-enqueue_tiles(std::queue<Rect> &q, const Rect &rect)
+int
+Worker::run_thread(void *w)
 {
-    dbg_assert(rect.size % TILE_SIZE == 0);
-    uint32_t ntiles = rect.size / TILE_SIZE;
-    for (uint32_t i = 0; i < ntiles; ++i)
-        q.push(Rect(rect.offset + i * TILE_SIZE, TILE_SIZE));
+    static_cast<Worker *>(w)->run();
+    return 0;
 }
 
-bool
-Worker::get_work(Rect &rect)
-{
-    bool success = false;
-    const auto nworkers = conf.nworkers;
-
-    lock();
-    success = queue_get(jobs, rect);
-    if (success && rect.size > TILE_SIZE) {
-        assert(jobs.empty());
-        enqueue_tiles(jobs,
-                      Rect(rect.offset + TILE_SIZE, rect.size - TILE_SIZE));
-        rect.size = TILE_SIZE;
-    }
-    unlock();
-
-    if (success)
-        return true;
-
-    // steal from other workers
-    uint32_t me = id;
-    for (uint32_t i = (me + 1) % nworkers; i != me; i = (i + 1) % nworkers) {
-        Worker &w = *renderer.workers[i];
-
-        w.lock();
-        success = !w.done_flag && queue_get(w.jobs, rect);
-        w.unlock();
-        if (success) {
-            if (rect.size > TILE_SIZE) {
-                lock();
-                enqueue_tiles(
-                  jobs, Rect(rect.offset + TILE_SIZE, rect.size - TILE_SIZE));
-                unlock();
-                ;
-            }
-            rect.size = TILE_SIZE;
-            return true;
-        }
+void
+Worker::run()
+{
+    dbg_assert(!is_coordinator());
+    renderer.pin_worker(id);
+
+    // the first generation of the frame barrier is not a frame, every worker
+    // first touches the memory of its own tiles
+    frame = renderer.frame_barrier->wait_frame_start(frame);
+    if (!shutdown) {
+        renderer.first_touch(id);
+        renderer.frame_barrier->frame_done();
     }
 
-    lock();
-    done_flag = true;
-    unlock();
-
-    return false;
+    while (!shutdown)
+        render_rects();
+    fprintf(stderr, "worker %d exiting\n", id);
 }
 
-static vecf_t __attribute__((always_inline))
-eval_cosine(const Uniforms &us, vecf_t t)
+void
+Uniforms::init(uint32_t nangles, uint32_t ncosines)
 {
+    rot_omega = float(0);
 
-    // union {
-    //     vecf_t::elem_type flat[vecf_t::size];
-    //     vecf_t packed;
-    // } x;
+    sincos_table.resize(2 * nangles);
+    for (uint32_t i = 0; i < nangles; ++i) {
+        float theta = float(i) * float(2 * M_PI / nangles);
+        sincos_table[i * 2] = std::sin(theta);
+        sincos_table[i * 2 + 1] = std::cos(theta);
+    }
+
+    // fold waves with opposite wave vectors (wave a and a + n/2 for even n)
+    // into pairs, whose sum only needs one cosine per pixel
+    std::vector<float> single, paired;
+    std::vector<bool> used(nangles);
+    for (uint32_t a = 0; a < nangles; ++a) {
+        if (used[a])
+            continue;
+        float s = sincos_table[2 * a];
+        float c = sincos_table[2 * a + 1];
+        uint32_t b = a + 1;
+        for (; b < nangles; ++b) {
+            const float eps = 1e-5f;
+            if (!used[b] && std::abs(sincos_table[2 * b] + s) < eps &&
+                std::abs(sincos_table[2 * b + 1] + c) < eps)
+                break;
+        }
+        auto &dst = b < nangles ? paired : single;
+        dst.push_back(s);
+        dst.push_back(c);
+        if (b < nangles)
+            used[b] = true;
+    }
 
-    // x.packed = t;
-    // for (uint32_t i = 0; i < vecf_t::size; ++i)
-    //     x.flat[i] = cosf(x.flat[i]);
+    nsingle = single.size() / 2;
+    npaired = paired.size() / 2;
+    wave_table = std::move(single);
+    wave_table.insert(wave_table.end(), paired.begin(), paired.end());
 
-    // return x.packed;
+    // we could take advantage of symmetry
+    // also most precision is needed near the zeroes, so it would be
+    // beneficial to stretch the domain accordingly
+    cosine_table.resize(ncosines + 1);
 
-    const vecf_t num_cosines = vecf(float(us.num_cosines()));
-    const vecf_t inv_tau = vecf(float(1.0 / (2.0 * M_PI)));
+    for (uint32_t i = 0; i < ncosines; ++i)
+        cosine_table[i] = cosf(float(i) * float(2 * M_PI / ncosines));
 
-    t = fract(t * inv_tau);
-    t *= num_cosines;
+    cosine_table[ncosines] = cosine_table[0]; // wrap around
 
-    veci_t i = veci(t);
-    // veci_t j = i + veci(1);
-    // vecf_t frac = t - vecf(i);
+    // a quarter wave at half the resolution of the full table, with linear
+    // interpolation this is still far more accurate. The trailing entries
+    // allow reading table[i + 1] (or a pair of int16s) for i == nquarter
+    const uint32_t nquarter = std::max(ncosines / 8, 2u);
+    quarter_table.resize(nquarter + 2);
+    quarter_table16.resize(nquarter + 2);
+
+    for (uint32_t i = 0; i < nquarter + 2; ++i) {
+        double c = std::cos(double(i) * (M_PI / 2) / nquarter);
+        quarter_table[i] = float(c);
+        quarter_table16[i] = int16_t(std::lrint(c * QUARTER16_ONE));
+    }
+}
 
-    const vecf_t a = index(us.cosine_table.data(), i);
-    // const vecf_t b = index(us->cosine_table, j);
+const RenderKernels *
+select_render_kernels(KernelIsa isa)
+{
+    __builtin_cpu_init();
+    const bool has_avx2 =
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    const bool has_avx512 = has_avx2 && __builtin_cpu_supports("avx512f");
+
+    switch (isa) {
+    case KernelIsa::Auto:
+        if (has_avx512)
+            return &render_kernels_avx512;
+        if (has_avx2)
+            return &render_kernels_avx2;
+        return &render_kernels_sse2;
+    case KernelIsa::SSE2:
+        return &render_kernels_sse2;
+    case KernelIsa::AVX2:
+        return has_avx2 ? &render_kernels_avx2 : nullptr;
+    case KernelIsa::AVX512:
+        return has_avx512 ? &render_kernels_avx512 : nullptr;
+    }
 
-    return a;
-    // return a + (b - a) * frac;
+    return nullptr;
 }
 
-static void __attribute__((noinline))
-transform_points(const AffineTrafo2 &RESTRICT M,
-                 uint32_t n,
-                 vecf_t *RESTRICT x,
-                 vecf_t *RESTRICT y)
+static const char *const RENDER_STAGE_NAMES[] = { "coords",
+                                                  "transform",
+                                                  "warp",
+                                                  "amplitudes",
+                                                  "color" };
+
+const char *
+render_stage_name(RenderStage stage)
 {
-    const vecf_t x_off = vecf(M.origin.coords.x);
-    const vecf_t y_off = vecf(M.origin.coords.y);
-    const vecf_t m11 = vecf(M.x.x);
-    const vecf_t m12 = vecf(M.y.x);
-    const vecf_t m21 = vecf(M.x.y);
-    const vecf_t m22 = vecf(M.y.y);
+    return RENDER_STAGE_NAMES[size_t(stage)];
+}
 
+// largest deviation of the selected cosine engine from the exact cosine,
+// sampled over a few periods around the origin and at larger arguments
+static double
+measure_cosine_error(const RenderKernels &kernels, const KernelArgs &args)
+{
+    const uint32_t n = 1 << 16;
+    std::vector<float> t(n), c(n);
     for (uint32_t i = 0; i < n; ++i) {
-        vecf_t vx = x[i];
-        vecf_t vy = y[i];
-        x[i] = vx * m11 + vy * m12 + x_off;
-        y[i] = vx * m21 + vy * m22 + y_off;
+        double x = (double(i) / n - 0.5) * 8 * M_PI;
+        if (i % 4 == 3)
+            x *= 64;
+        t[i] = float(x);
     }
+
+    kernels.eval_cosines(args, n, t.data(), c.data());
+
+    double max_err = 0;
+    for (uint32_t i = 0; i < n; ++i)
+        max_err = std::max(max_err, std::abs(c[i] - std::cos(double(t[i]))));
+    return max_err;
 }
 
-static void __attribute__((noinline))
-calculate_amplitudes(const Uniforms &us,
-                     const uint32_t n,
-                     const vecf_t *RESTRICT x,
-                     const vecf_t *RESTRICT y,
-                     vecf_t *RESTRICT amp)
+void
+Transforms::init(uint32_t w, uint32_t h)
 {
-    const vecf_t init_amp = vecf(float(us.num_angles()));
+    float scale = float(150);
 
-    for (uint32_t i = 0; i < n; ++i)
-        amp[i] = init_amp;
+    float invX = scale / float(w);
+    float invY = scale / float(h);
+    inverseWorld.x = vec2{ invX, 0 };
+    inverseWorld.y = vec2{ 0, invY };
+    inverseWorld.origin = point2{ -0.5f * scale * vec2{ 1, 1 } };
+}
 
-    const vecf_t time = vecf(us.time);
+// The original warp measured r = sqrt(sqr(x * (1 / 7)) + sqr(y * (1 / 2))),
+// the integer divisions make r zero everywhere. What is left is the uniform
+// scale (1 + 0.01 / 0.001 * dt) * scale, with dt = 0.08 and scale = 0.5.
+const float LEGACY_WARP_SCALE = 0.9f;
 
-    for (uint32_t a = 0; a < us.num_angles(); ++a) {
-        vecf_t scale_y = vecf(us.sincos_table[2 * a]);
-        vecf_t scale_x = vecf(us.sincos_table[2 * a + 1]);
+KernelArgs
+make_kernel_args(const Config &conf,
+                 const Uniforms &uniforms,
+                 const Transforms &trafos,
+                 std::vector<float> &waves)
+{
+    // k . R p = (R^T k) . p, rotating the few wave vectors instead of every
+    // pixel keeps the world coordinates independent of the rotation
+    const AffineTrafo2 &R = trafos.rotation;
+    waves.resize(uniforms.wave_table.size());
+    for (size_t i = 0; i < waves.size(); i += 2) {
+        vec2 k = { uniforms.wave_table[i + 1], uniforms.wave_table[i] };
+        waves[i] = dot(R.y, k);
+        waves[i + 1] = dot(R.x, k);
+    }
 
-        for (uint32_t k = 0; k < n; ++k) {
-            vecf_t t = time;
-            t += x[k] * scale_x;
-            t += y[k] * scale_y;
-            amp[k] += eval_cosine(us, t);
-        }
+    KernelArgs args;
+    args.wave_table = waves.data();
+    args.cosine_table = uniforms.cosine_table.data();
+    args.nangles = uniforms.num_angles();
+    args.nsingle = uniforms.nsingle;
+    args.npaired = uniforms.npaired;
+    args.ncosines = uniforms.num_cosines();
+    args.quarter_table = uniforms.quarter_table.data();
+    args.quarter_table16 = uniforms.quarter_table16.data();
+    args.nquarter = uniforms.num_quarter_cosines();
+    args.time = float(uniforms.time);
+    args.cosine = conf.cosine;
+    args.warp = conf.warp;
+    args.amplitudes = conf.amplitudes;
+    args.tile_pixels = conf.tile_w * conf.tile_h;
+    args.pixel_to_world = trafos.inverseWorld;
+    if (conf.warp == WarpMode::Legacy) {
+        const float s = LEGACY_WARP_SCALE;
+        args.pixel_to_world = AffineTrafo2(vec2{ s, 0 }, vec2{ 0, s }) *
+                              args.pixel_to_world;
     }
+    args.world_coords = nullptr;
+    args.wave_sums = nullptr;
+    return args;
 }
 
-#if 0
-static float
-fractf(float x)
+KernelArgs
+Renderer::kernel_args(std::vector<float> &waves) const
 {
-    if (x < 0)
-        x = -x;
-    return x - float(int(x));
+    KernelArgs args = make_kernel_args(conf, uniforms, trafos, waves);
+    args.world_coords = world_cache.data.get();
+    args.wave_sums = wave_sums.data.get();
+    return args;
 }
 
-static vec2
-cart2polar(float x, float y)
+// runs fill(args, tile, cache) for every tile of the image, spread over
+// nworkers threads of its own: the workers are waiting for the next frame.
+// Thread i fills the slice of worker i on its cpu, the caller is worker 0.
+template<typename Fill>
+static void
+fill_pixel_cache(const Config &conf,
+                 const std::vector<CpuTopology::Cpu> &placement,
+                 const KernelArgs &args,
+                 const PixelCache &cache,
+                 Fill fill)
 {
-    float r = sqrtf(x * x + y * y);
-    float phi;
+    const TileGrid &grid = cache.key.grid;
+    const uint32_t ntiles = grid.ntiles();
+    float *data = cache.data.get();
+
+    auto fill_tiles = [&](uint32_t worker) {
+        if (worker > 0 && !placement.empty())
+            pin_current_thread(placement[worker].id);
+        uint32_t first, count;
+        TileScheduler::slice(ntiles, conf.nworkers, worker, first, count);
+        for (uint32_t i = first; i < first + count; ++i)
+            fill(args, grid.rect(i), data);
+    };
 
-    if (r == 0) {
-        phi = 0;
-    } else if (y == 0 && x < 0) {
-        phi = 0.5;
-    } else {
-        phi = atan2f(y, r + x) * (1 / M_PI);
-    }
+    std::vector<std::thread> threads;
+    for (uint32_t t = 1; t < conf.nworkers; ++t)
+        threads.emplace_back(fill_tiles, t);
+    fill_tiles(0);
+    for (auto &t : threads)
+        t.join();
+}
 
-    phi *= float(2 * M_PI);
-    vec2 v;
-    v.x = phi;
-    v.y = r;
-    return v;
+// Recomputes the caches whose geometry changed. Only called while all
+// workers wait for the next frame.
+void
+Renderer::update_pixel_caches()
+{
+    PixelCache::Key key;
+    key.grid = grid;
+    key.trafo = trafos.inverseWorld;
+
+    std::vector<float> waves;
+    KernelArgs args = make_kernel_args(conf, uniforms, trafos, waves);
+
+    if (!Config::warp_is_affine(conf.warp) && world_cache.update(key)) {
+        fill_pixel_cache(
+          conf, placement, args, world_cache, kernels->warp_tile);
+        if (conf.verbose)
+            fprintf(stderr,
+                    "cached warped world coordinates (%u KB)\n",
+                    unsigned(world_cache.byte_size() / 1024));
+    }
+    args.world_coords = world_cache.data.get();
+
+    key.rotation = trafos.rotation;
+    if (conf.amplitudes == AmplitudeKernel::Separable &&
+        wave_sums.update(key)) {
+        StopWatch watch;
+        watch.start();
+        fill_pixel_cache(
+          conf, placement, args, wave_sums, kernels->wave_sums_tile);
+        if (conf.verbose)
+            fprintf(stderr,
+                    "precomputed wave sums in %.1f ms (%u KB)\n",
+                    watch.now() * 1000,
+                    unsigned(wave_sums.byte_size() / 1024));
+    }
 }
-#endif
 
-static float
-sqr(float x)
+size_t
+Uniforms::table_bytes(CosineMode mode) const
 {
-    return x * x;
+    switch (mode) {
+    case CosineMode::Table:
+        return cosine_table.size() * sizeof cosine_table[0];
+    case CosineMode::Quarter:
+        return quarter_table.size() * sizeof quarter_table[0];
+    case CosineMode::Quarter16:
+        return quarter_table16.size() * sizeof quarter_table16[0];
+    default:
+        return 0;
+    }
 }
 
-static void __attribute__((always_inline))
-warp_world(uint32_t n, vecf_t *RESTRICT x, vecf_t *RESTRICT y)
+void
+Renderer::start_new_frame()
 {
-    for (uint32_t i = 0; i < n; ++i) {
+    update_pixel_caches();
 
-        union
-        {
-            vecf_t::elem_type flat[vecf_t::size];
-            vecf_t packed;
-        } x0, y0, x1, y1;
-
-        x0.packed = x[i];
-        y0.packed = y[i];
-
-        const float dt = 0.08;
-        const float scale = 0.5;
-
-        for (uint32_t j = 0; j < vecf_t::size; ++j) {
-            float x = x0.flat[j];
-            float y = y0.flat[j];
-            float xt, yt;
-
-            float fx, fy;
-            float r = sqrtf(sqr(x * (1 / 7)) + sqr(y * (1 / 2)));
-            float d = r * 0.5 + cosf(r * 0.4) * 0.01;
-            float invR = float(1) / (r + float(0.001));
-            fx = d * invR * x;
-            fy = d * invR * y;
-            xt = x;
-            yt = y;
-
-            x1.flat[j] = (xt + fx * dt) * scale;
-            y1.flat[j] = (yt + fy * dt) * scale;
-        }
+    // invariant: Workers are all waiting on the frame barrier, which
+    // publishes the new frame to them
+    scheduler->start_frame(grid.ntiles());
+    frame_start_ns = now_ns();
+    frame_barrier->start_frame();
+}
 
-        x[i] = x1.packed;
-        y[i] = y1.packed;
-    }
+// The view stays the same, Transforms::init maps every image size to the same
+// part of the world.
+void
+Renderer::set_render_size(uint32_t w, uint32_t h)
+{
+    if (w == grid.img_w && h == grid.img_h)
+        return;
+    grid.init(w, h, conf.tile_w, conf.tile_h);
+    trafos.init(w, h);
 }
 
-static void __attribute__((noinline)) draw_crystal(const Uniforms &us,
-                                                   const Transforms &trafos,
-                                                   const Rect &RESTRICT rect,
-                                                   Image &img)
+void
+Renderer::set_anim_time(double anim_time)
 {
+    uniforms.time = anim_time * conf.time_speed + conf.time_t0;
+    trafos.rotation = AffineTrafo2::rotation(uniforms.rot_omega * anim_time);
+}
 
-    dbg_assert(rect.size == TILE_SIZE);
-    dbg_assert(img.w % 4 == 0);
-    dbg_assert(rect.offset % TILE_SIZE == 0);
-    dbg_assert(TILE_SIZE % veci_t::size == 0 && TILE_SIZE % vecf_t::size == 0);
+void
+Renderer::render(Frame &frame)
+{
+    set_anim_time(frame.anim_time);
+    target = &frame.image;
 
-    const uint32_t y0 = rect.offset / img.w;
-    const uint32_t x0 = rect.offset % img.w;
+    start_new_frame();
+    workers[0]->render_rects();
 
-    const uint32_t yn = (rect.offset + rect.size) / img.w;
-    const uint32_t xn = (rect.offset + rect.size) % img.w;
+    StopWatch watch;
+    watch.start();
+    frame_barrier->wait_frame_done();
+    frame_end_ns = now_ns();
+    if (conf.verbose) {
+        FrameBarrier::Stats s = frame_barrier->stats();
+        std::lock_guard lk(ring_mutex);
+        ++barrier_stats.frames;
+        barrier_stats.wake_sum += s.wake_avg;
+        barrier_stats.wake_max = std::max(barrier_stats.wake_max, s.wake_max);
+        barrier_stats.done_wait_sum += watch.now();
+    }
 
-    dbg_assert(xn % 4 == 0);
+#ifdef DEBUG_IMAGE_VERSION
+    for (uint32_t i = 1; i < conf.nworkers; ++i) {
+        workers[i]->lock();
+        assert(workers[i]->version == workers[0]->version);
+        assert(workers[i]->image == workers[0]->image);
+        workers[i]->unlock();
+    }
+#endif
+}
 
-    union
-    {
-        RGBA *data;
-        veci_t *packed;
-    } color_buf;
+// The counters of the scheduler and the time stamps of the workers are
+// published by the frame barrier, read them before the next frame starts.
+FrameStats
+Renderer::collect_frame_stats(const Frame &frame) const
+{
+    auto seconds = [](uint64_t from, uint64_t to) {
+        return to > from ? double(to - from) * 1e-9 : 0.0;
+    };
 
-    color_buf.data = &img(x0, y0);
-    dbg_assert((uintptr_t) color_buf.packed % sizeof(vecf_t) == 0);
+    FrameStats stats;
+    stats.id = frame.id;
+    stats.render_time = frame.render_time;
+    stats.workers.resize(conf.nworkers);
+    for (uint32_t i = 0; i < conf.nworkers; ++i) {
+        const Worker &w = *workers[i];
+        const TileScheduler::Counters &c = scheduler->counters(i);
+        WorkerFrameStats &s = stats.workers[i];
+        s.tiles = c.tiles;
+        s.stolen = c.stolen;
+        s.failed_steals = c.failed_steals;
+        s.start_wait = seconds(frame_start_ns, w.wake_ns);
+        s.busy = seconds(w.wake_ns, w.done_ns);
+        s.done_wait = seconds(w.done_ns, frame_end_ns);
+    }
+    return stats;
+}
 
-    const auto TILE_SIZE4 = TILE_SIZE / vecf_t::size;
-    vecf_t xcoord[TILE_SIZE4];
-    vecf_t ycoord[TILE_SIZE4];
+// frames whose statistics are kept until somebody takes them, a few seconds
+// at high frame rates
+const size_t MAX_FRAME_STATS = 1 << 14;
 
-    {
-        uint32_t off4 = 0;
-        const uint32_t w4 = img.w / vecf_t::size;
-        dbg_assert(img.w % vecf_t::size == 0);
-
-        vecf_t::elem_type x_init_data[vecf_t::size];
-        for (uint32_t i = 0; i < vecf_t::size; ++i)
-            x_init_data[i] = float(i);
-
-        const vecf_t x_init = vecf(x_init_data);
-        const vecf_t x_step = vecf(float(vecf_t::size));
-        const vecf_t y_step = vecf(float(1));
-
-        vecf_t xf = vecf(float(x0)) + x_init;
-        vecf_t yf = vecf(float(y0));
-        auto yfirst = (x0 == 0 && y0 < yn) ? y0 : y0 + 1;
-
-        if (y0 < yfirst) {
-            for (uint32_t i = 0; i < std::min(TILE_SIZE4, w4 - x0 / 4);
-                 ++i, ++off4) {
-                xcoord[off4] = xf;
-                ycoord[off4] = yf;
-                xf += x_step;
-            }
+// Renders the frames in order into free slots of the ring. Outside of capture
+// and benchmark mode the frames are started at most conf.fps times per
+// second, a frame that took longer delays the animation instead of skipping
+// ahead.
+void
+Renderer::run_coordinator()
+{
+    const double frame_time = 1 / double(conf.fps);
+    const bool paced = !is_capture_mode() && !is_bench_mode();
+    const uint64_t max_frames = is_bench_mode()     ? conf.nbench
+                                : is_capture_mode() ? conf.ncapture
+                                                    : 0;
+
+    pin_worker(0);
+    frame_barrier->start_frame();
+    first_touch(0);
+    frame_barrier->wait_frame_done();
+
+    StopWatch watch;
+    watch.start();
+    // frame id starts rendering at start_ns + (id - first) * frame_ns
+    const uint64_t frame_ns = uint64_t(1e9 / conf.fps);
+    const uint64_t start_ns = now_ns();
+
+    // the time of a frame only depends on its id, so a range of frames
+    // renders the same as in a run from the start
+    const uint64_t first = uint64_t(conf.first_frame) + 1;
+    for (uint64_t id = first; max_frames == 0 || id < first + max_frames;
+         ++id) {
+        Frame *frame = nullptr;
+        {
+            std::unique_lock lk(ring_mutex);
+            ring_changed.wait(lk, [&] {
+                for (auto &f : frames)
+                    if (f.state == Frame::Free) {
+                        frame = &f;
+                        break;
+                    }
+                return frame || stopping;
+            });
+            if (stopping)
+                return;
+            frame->state = Frame::Rendering;
         }
 
-        yf += y_step;
-        for (uint32_t y = yfirst; y < yn; ++y) {
-            xf = x_init;
-            for (uint32_t i = 0; i < w4; ++i, ++off4) {
-                xcoord[off4] = xf;
-                ycoord[off4] = yf;
-                xf += x_step;
+        // Frames whose deadline has passed by a whole frame are skipped, so
+        // the animation keeps its speed when rendering falls behind and
+        // does not race through the missed frames once it caught up.
+        if (paced) {
+            const uint64_t due = (now_ns() - start_ns) / frame_ns + first;
+            if (due > id) {
+                std::lock_guard lk(ring_mutex);
+                deadlines_missed += uint32_t(due - id);
+                id = due;
             }
-            yf += y_step;
+            sleep_until_ns(start_ns + (id - first) * frame_ns);
         }
 
-        if (yn > y0) {
-            xf = x_init;
-            for (uint32_t i = 0; i < xn / 4; ++i, ++off4) {
-                xcoord[off4] = xf;
-                ycoord[off4] = yf;
-                xf += x_step;
-            }
-        }
+        frame->id = id;
+        frame->anim_time = double(id) * frame_time;
+        if (scaler)
+            set_render_size(scaler->width(), scaler->height());
+        frame->image.resize(grid.img_w, grid.img_h);
+        const double t0 = watch.now();
+        render(*frame);
+        frame->render_time = watch.now() - t0;
+        FrameStats stats = collect_frame_stats(*frame);
+        if (scaler && scaler->update(frame->render_time) && conf.verbose)
+            fprintf(stderr,
+                    "rendering at %ux%u\n",
+                    unsigned(scaler->width()),
+                    unsigned(scaler->height()));
 
-        dbg_assert(off4 == TILE_SIZE4);
+        {
+            std::lock_guard lk(ring_mutex);
+            frame->state = Frame::Ready;
+            frame_stats.push_back(std::move(stats));
+            if (frame_stats.size() > MAX_FRAME_STATS)
+                frame_stats.pop_front();
+        }
+        ring_changed.notify_all();
     }
+}
 
-    auto trans = trafos.rotation * trafos.inverseWorld;
-    transform_points(trans, TILE_SIZE / vecf_t::size, xcoord, ycoord);
-    warp_world(TILE_SIZE / vecf_t::size, xcoord, ycoord);
-
-    vecf_t amp[TILE_SIZE4];
-    calculate_amplitudes(us, TILE_SIZE / vecf_t::size, xcoord, ycoord, amp);
-
-    const vecf_t max_lum = vecf(float(255));
-    const veci_t alpha = veci((int) (255U << 24));
-
-    for (uint32_t i = 0; i < TILE_SIZE4; ++i) {
-        vecf_t x = amp[i] * vecf(float(0.5));
-        vecf_t t = fract_positive(x);
-
-        vecf_t lum = t * t * (vecf(3) - vecf(2) * t) * max_lum;
-        veci_t lumi = veci(lum);
+Frame *
+Renderer::acquire_next()
+{
+    std::unique_lock lk(ring_mutex);
+    Frame *frame = nullptr;
+    ring_changed.wait(lk, [&] {
+        for (auto &f : frames)
+            if (f.state == Frame::Ready && f.id == last_acquired + 1)
+                frame = &f;
+        return frame || stopping;
+    });
+    if (!frame)
+        return nullptr;
+    frame->state = Frame::Acquired;
+    last_acquired = frame->id;
+    return frame;
+}
 
-        lumi = lumi | (lumi << 8) | (lumi << 16);
-        color_buf.packed[i] = lumi | alpha;
+Frame *
+Renderer::acquire_latest(double timeout)
+{
+    Frame *frame = nullptr;
+    {
+        std::unique_lock lk(ring_mutex);
+        ring_changed.wait_for(
+          lk, std::chrono::duration<double>(timeout), [&] {
+              for (auto &f : frames)
+                  if (f.state == Frame::Ready && (!frame || f.id > frame->id))
+                      frame = &f;
+              return frame || stopping;
+          });
+        if (!frame)
+            return nullptr;
+
+        for (auto &f : frames)
+            if (f.state == Frame::Ready && &f != frame) {
+                f.state = Frame::Free;
+                ++frames_skipped;
+            }
+        frame->state = Frame::Acquired;
+        last_acquired = frame->id;
     }
+    ring_changed.notify_all();
+    return frame;
 }
 
 void
-Worker::render_rects()
+Renderer::release(Frame *frame)
 {
-    done_flag = false;
-
-    if (!is_coordinator())
-        start_frame_barrier.wait();
-    else
-        ++renderer.render_version;
-
-    if (shutdown)
-        return;
-
-    image = &renderer.images[image == &renderer.images[0]];
-    ++version;
-
-    for (;;) {
+    {
+        std::lock_guard lk(ring_mutex);
+        dbg_assert(frame->state == Frame::Acquired);
+        frame->state = Frame::Free;
+    }
+    ring_changed.notify_all();
+}
 
-        Rect rect;
-        if (!get_work(rect))
-            break;
-        draw_crystal(renderer.uniforms, renderer.trafos, rect, *image);
+Renderer::StageProfile
+Renderer::profile_stages(uint32_t nframes)
+{
+    const double frame_time = 1 / double(conf.fps);
+    Image img;
+    img.init(grid.img_w, grid.img_h);
+
+    uint64_t ticks[NUM_RENDER_STAGES] = {};
+    uint64_t total_ticks = 0;
+    double total_seconds = 0;
+    std::vector<float> waves;
+
+    for (uint32_t id = 1; id <= nframes; ++id) {
+        set_anim_time(double(id) * frame_time);
+        update_pixel_caches();
+        const KernelArgs args = kernel_args(waves);
+
+        StopWatch watch;
+        watch.start();
+        const uint64_t t0 = __rdtsc();
+        for (uint32_t i = 0; i < grid.ntiles(); ++i)
+            kernels->profile_tile(
+              args, grid.rect(i), img.stride, img.data(), ticks);
+        total_ticks += __rdtsc() - t0;
+        total_seconds += watch.now();
     }
 
-    if (!is_coordinator())
-        done_frame_barrier.notify();
+    // the tsc rate is taken from the same runs
+    StageProfile profile;
+    profile.frames = nframes;
+    if (total_ticks > 0)
+        for (uint32_t s = 0; s < NUM_RENDER_STAGES; ++s)
+            profile.seconds[s] = double(ticks[s]) * total_seconds /
+                                 double(total_ticks) / nframes;
+    return profile;
 }
 
-int
-Worker::run_thread(void *w)
+Renderer::BarrierStats
+Renderer::take_barrier_stats()
 {
-    static_cast<Worker *>(w)->run();
-    return 0;
+    std::lock_guard lk(ring_mutex);
+    BarrierStats s = barrier_stats;
+    barrier_stats = BarrierStats();
+    return s;
 }
 
-void
-Worker::run()
+std::vector<FrameStats>
+Renderer::take_frame_stats()
 {
-    dbg_assert(!is_coordinator());
-    while (!shutdown)
-        render_rects();
-    fprintf(stderr, "worker %d exiting\n", id);
+    std::lock_guard lk(ring_mutex);
+    std::vector<FrameStats> stats(std::make_move_iterator(frame_stats.begin()),
+                                  std::make_move_iterator(frame_stats.end()));
+    frame_stats.clear();
+    return stats;
 }
 
-void
-Uniforms::init(uint32_t nangles, uint32_t ncosines)
+uint32_t
+Renderer::take_frames_skipped()
 {
-    rot_omega = float(0);
-
-    sincos_table.resize(2 * nangles);
-    for (uint32_t i = 0; i < nangles; ++i) {
-        float theta = float(i) * float(2 * M_PI / nangles);
-        sincos_table[i * 2] = std::sin(theta);
-        sincos_table[i * 2 + 1] = std::cos(theta);
-    }
-
-    // we could take advantage of symmetry
-    // also most precision is needed near the zeroes, so it would be
-    // beneficial to stretch the domain accordingly
-    cosine_table.resize(ncosines + 1);
-
-    for (uint32_t i = 0; i < ncosines; ++i)
-        cosine_table[i] = cosf(float(i) * float(2 * M_PI / ncosines));
+    std::lock_guard lk(ring_mutex);
+    uint32_t n = frames_skipped;
+    frames_skipped = 0;
+    return n;
+}
 
-    cosine_table[ncosines] = cosine_table[0]; // wrap around
+uint32_t
+Renderer::take_deadlines_missed()
+{
+    std::lock_guard lk(ring_mutex);
+    uint32_t n = deadlines_missed;
+    deadlines_missed = 0;
+    return n;
 }
 
 void
-Renderer::start_new_frame()
+Renderer::pin_worker(uint32_t id)
 {
-    uint32_t ntiles = CEIL_DIV(conf.img_w * conf.img_h, TILE_SIZE);
-    uint32_t slice = ntiles / conf.nworkers;
-    uint32_t rest = ntiles % conf.nworkers;
-    uint32_t offset = 0;
-
-    for (uint32_t i = 0; i < conf.nworkers; ++i) {
-        // invariant: Workers are all blocked on work_barrier
-        // we still need to lock, to ensure proper memory ordering
-        uint32_t sz =
-          TILE_SIZE * (i >= conf.nworkers - rest ? slice + 1 : slice);
-        if (sz > 0) {
-            workers[i]->lock();
-            workers[i]->jobs.push(Rect(offset, sz));
-            workers[i]->unlock();
-        }
-        offset += sz;
-    }
-
-    for (uint32_t i = 1; i < conf.nworkers; ++i)
-        workers[i]->start_frame_barrier.notify();
+    if (!placement.empty() && !pin_current_thread(placement[id].id))
+        fprintf(stderr,
+                "failed to pin worker %u to cpu %u\n",
+                unsigned(id),
+                unsigned(placement[id].id));
 }
 
+// Zeroes the tiles of worker id in all frame images, Linux places a page on
+// the NUMA node of the cpu that writes it first.
 void
-Renderer::render()
+Renderer::first_touch(uint32_t id)
 {
-    workers[0]->render_rects();
-
-    for (uint32_t i = 1; i < conf.nworkers; ++i)
-        workers[i]->done_frame_barrier.wait();
-
-#ifdef DEBUG_IMAGE_VERSION
-    for (uint32_t i = 1; i < conf.nworkers; ++i) {
-        workers[i]->lock();
-        assert(workers[i]->version == workers[0]->version);
-        assert(workers[i]->image == workers[0]->image);
-        workers[i]->unlock();
+    uint32_t first, count;
+    TileScheduler::slice(grid.ntiles(), conf.nworkers, id, first, count);
+    for (auto &f : frames) {
+        for (uint32_t i = first; i < first + count; ++i) {
+            Rect r = grid.rect(i);
+            uint32_t w = CEIL_DIV(r.w, TILE_ALIGN) * TILE_ALIGN;
+            for (uint32_t y = r.y; y < r.y + r.h; ++y)
+                memset(&f.image(r.x, y), 0, w);
+        }
     }
-#endif
-
-    start_new_frame();
-
-    int imidx = (workers[0]->image == &images[0]) ? 0 : 1;
-    assert(srcImage != &images[imidx]);
-    srcImage = &images[imidx];
-    assert(srcVersion + 1 == render_version);
-    srcVersion = render_version;
 }
 
 bool
 Renderer::init_workers()
 {
+    CpuTopology topo = CpuTopology::detect();
+    placement = topo.place_workers(conf.nworkers, conf.affinity);
+
+    std::vector<uint32_t> nodes;
+    for (auto &cpu : placement)
+        nodes.push_back(cpu.node);
+    scheduler =
+      std::make_unique<TileScheduler>(conf.sched, conf.nworkers, nodes);
+
+    if (conf.verbose) {
+        fprintf(stderr,
+                "%u usable cpus, %u cores, %u NUMA nodes",
+                unsigned(topo.cpus.size()),
+                unsigned(topo.num_cores()),
+                unsigned(topo.nnodes));
+        if (topo.cpu_quota > 0)
+            fprintf(stderr, ", cgroup quota %u cpus", unsigned(topo.cpu_quota));
+        fprintf(stderr, "\n");
+        for (uint32_t i = 0; i < placement.size(); ++i)
+            fprintf(stderr,
+                    "worker %u: cpu %u, core %u, node %u\n",
+                    unsigned(i),
+                    unsigned(placement[i].id),
+                    unsigned(placement[i].core),
+                    unsigned(placement[i].node));
+    }
+    frame_barrier =
+      std::make_unique<FrameBarrier>(conf.nworkers - 1, conf.verbose);
+
     for (uint32_t i = 0; i < conf.nworkers; ++i)
         workers.push_back(std::make_unique<Worker>(conf, *this, i));
 
     uint32_t i;
 
     // dont start thread 0, thread 0's work will be executed by the
-    // main thread
+    // coordinator thread
     for (i = 1; i < conf.nworkers; ++i)
         if (!workers[i]->start())
             goto shutdown;
 
-    start_new_frame();
+    coordinator = std::thread(&Renderer::run_coordinator, this);
     return true;
 
 shutdown:
 
-    for (uint32_t k = 1; k < i; ++k) {
+    for (uint32_t k = 1; k < i; ++k)
         workers[k]->shutdown = true;
-        workers[k]->start_frame_barrier.notify();
-    }
+    frame_barrier->start_frame();
 
     for (uint32_t k = 1; k < i; ++k)
         workers[k]->wait_shutdown();
@@ -577,10 +815,17 @@ shutdown:
 void
 Renderer::shutdown()
 {
-    for (uint32_t i = 1; i < conf.nworkers; ++i) {
-        workers[i]->shutdown = true;
-        workers[i]->start_frame_barrier.notify();
+    {
+        std::lock_guard lk(ring_mutex);
+        stopping = true;
     }
+    ring_changed.notify_all();
+    if (coordinator.joinable())
+        coordinator.join();
+
+    for (uint32_t i = 1; i < conf.nworkers; ++i)
+        workers[i]->shutdown = true;
+    frame_barrier->start_frame();
 
     for (uint32_t i = 1; i < conf.nworkers; ++i)
         workers[i]->wait_shutdown();
@@ -592,12 +837,61 @@ Renderer::init()
     uint32_t img_w = conf.img_w;
     uint32_t img_h = conf.img_h;
 
-    images[0].init(img_w, img_h, TILE_SIZE);
-    images[1].init(img_w, img_h, TILE_SIZE);
+    kernels = select_render_kernels(conf.isa);
+    if (!kernels) {
+        fprintf(stderr,
+                "instruction set %s is not supported by this cpu\n",
+                Config::isa_name(conf.isa));
+        return false;
+    }
+
+    if (conf.verbose)
+        fprintf(stderr,
+                "using %s kernels (%u lanes)\n",
+                kernels->isa,
+                unsigned(kernels->lanes));
+
+    grid.init(img_w, img_h, conf.tile_w, conf.tile_h);
+    if (conf.verbose)
+        fprintf(stderr,
+                "%u tiles of %ux%u pixels\n",
+                unsigned(grid.ntiles()),
+                unsigned(grid.tile_w),
+                unsigned(grid.tile_h));
+
+    frames.resize(conf.nframes);
+    for (auto &f : frames)
+        f.image.init(img_w, img_h);
 
     uniforms.init(conf.nwaves, conf.ncosines);
     trafos.init(img_w, img_h);
 
+    if (!is_capture_mode() && !is_bench_mode() && conf.min_scale < 100)
+        scaler = std::make_unique<ResolutionScaler>(
+          img_w, img_h, conf.min_scale, conf.fps);
+
+    std::vector<float> waves;
+
+    if (conf.verbose)
+        fprintf(stderr,
+                "cosine engine %s: max error %g, table size %u bytes\n",
+                Config::cosine_name(conf.cosine),
+                measure_cosine_error(*kernels, kernel_args(waves)),
+                unsigned(uniforms.table_bytes(conf.cosine)));
+
+    if (conf.verbose)
+        fprintf(stderr,
+                "evaluating %u of %u waves per pixel (%u opposite pairs)\n",
+                unsigned(uniforms.nsingle + uniforms.npaired),
+                unsigned(uniforms.num_angles()),
+                unsigned(uniforms.npaired));
+
+    if (conf.amplitudes == AmplitudeKernel::Recurrence &&
+        conf.warp != WarpMode::None && conf.warp != WarpMode::Legacy)
+        fprintf(stderr,
+                "warning: the recurrence kernel needs -w legacy or none, "
+                "falling back to direct evaluation\n");
+
     return init_workers();
 }
 
@@ -606,21 +900,3 @@ delete_worker(Worker *w)
 {
     delete w;
 }
-
-void
-Barrier::wait()
-{
-    std::unique_lock lk(mutex);
-    condition.wait(lk, [this] { return open; });
-    open = false;
-}
-
-void
-Barrier::notify()
-{
-    {
-        std::lock_guard lk(mutex);
-        open = true;
-    }
-    condition.notify_one();
-}
@@ -1,13 +1,23 @@
 #pragma once
 
-#include "BMP.hpp"
 #include "Config.hpp"
 #include "euclidean2d.hpp"
+#include "frame_barrier.hpp"
+#include "render_kernels.hpp"
+#include "resolution.hpp"
+#include "scheduler.hpp"
+#include "topology.hpp"
+#include "worker_stats.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdlib>
+#include <deque>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 struct Worker;
@@ -23,40 +33,164 @@ struct default_delete<Worker>
 };
 } // namespace std
 
+// rows start at multiples of TILE_ALIGN bytes, align the whole image for
+// the widest backend
+const uint32_t IMAGE_ALIGNMENT = 64;
+
+struct FreeDeleter
+{
+    void operator()(void *p) const { std::free(p); }
+};
+
+// 8 bit luminances, expanded to the pixel format of the display only when
+// drawn. Rows are stride pixels apart, the width given to init() rounded up
+// to a multiple of TILE_ALIGN.
 struct Image
 {
     uint32_t w, h;
-    std::unique_ptr<RGBA[]> _data;
+    uint32_t stride;
+    // the height given to init()
+    uint32_t max_h;
+    std::unique_ptr<uint8_t[], FreeDeleter> _data;
+
+    void init(uint32_t w, uint32_t h)
+    {
+        this->w = w;
+        this->h = h;
+        max_h = h;
+        stride = CEIL_DIV(w, TILE_ALIGN) * TILE_ALIGN;
+        auto byte_size =
+          CEIL_DIV(size_t(stride) * h, IMAGE_ALIGNMENT) * IMAGE_ALIGNMENT;
+        _data.reset(static_cast<uint8_t *>(
+          std::aligned_alloc(IMAGE_ALIGNMENT, byte_size)));
+    }
 
-    void init(uint32_t w, uint32_t h, uint32_t block_size)
+    // uses the top left w x h pixels, up to the size given to init()
+    void resize(uint32_t w, uint32_t h)
     {
+        assert(CEIL_DIV(w, TILE_ALIGN) * TILE_ALIGN <= stride && h <= max_h);
         this->w = w;
         this->h = h;
-        auto img_size = CEIL_DIV(w * h, block_size) * block_size;
-        _data.reset(new RGBA[img_size]);
     }
 
-    RGBA &operator()(uint32_t x, uint32_t y)
+    uint8_t &operator()(uint32_t x, uint32_t y)
+    {
+        return _data[INDEX_2D(x, y, stride)];
+    }
+
+    const uint8_t &operator()(uint32_t x, uint32_t y) const
+    {
+        return _data[INDEX_2D(x, y, stride)];
+    }
+
+    const uint8_t *data() const { return _data.get(); }
+
+    uint8_t *data() { return _data.get(); }
+};
+
+// The image split into tiles of tile_w x tile_h pixels, numbered row by row.
+// The tiles in the last column and row are clipped to the image.
+struct TileGrid
+{
+    uint32_t img_w = 0, img_h = 0;
+    uint32_t tile_w = 0, tile_h = 0;
+    uint32_t tiles_x = 0, tiles_y = 0;
+
+    void init(uint32_t img_w, uint32_t img_h, uint32_t tile_w, uint32_t tile_h)
+    {
+        this->img_w = img_w;
+        this->img_h = img_h;
+        this->tile_w = tile_w;
+        this->tile_h = tile_h;
+        tiles_x = CEIL_DIV(img_w, tile_w);
+        tiles_y = CEIL_DIV(img_h, tile_h);
+    }
+
+    uint32_t ntiles() const { return tiles_x * tiles_y; }
+
+    uint32_t tile_pixels() const { return tile_w * tile_h; }
+
+    Rect rect(uint32_t i) const
     {
-        return _data[INDEX_2D(x, y, w)];
+        Rect r;
+        r.x = i % tiles_x * tile_w;
+        r.y = i / tiles_x * tile_h;
+        r.w = std::min(tile_w, img_w - r.x);
+        r.h = std::min(tile_h, img_h - r.y);
+        r.index = i;
+        return r;
     }
 
-    const RGBA &operator()(uint32_t x, uint32_t y) const
+    bool operator==(const TileGrid &g) const
     {
-        return _data[INDEX_2D(x, y, w)];
+        return img_w == g.img_w && img_h == g.img_h && tile_w == g.tile_w &&
+               tile_h == g.tile_h;
     }
+};
+
+// Per pixel data that only changes with the geometry: two floats per pixel in
+// the tile layout of KernelArgs::world_coords, computed for the geometry in
+// key.
+struct PixelCache
+{
+    struct Key
+    {
+        TileGrid grid;
+        AffineTrafo2 trafo;
+        AffineTrafo2 rotation;
+
+        bool operator==(const Key &k) const
+        {
+            return grid == k.grid && trafo == k.trafo &&
+                   rotation == k.rotation;
+        }
+    };
 
-    const RGBA *data() const { return _data.get(); }
+    std::unique_ptr<float[], FreeDeleter> data;
+    Key key;
 
-    RGBA *data() { return _data.get(); }
+    // returns true if the cache has to be recomputed for k, the storage for
+    // the new size is allocated by then
+    bool update(const Key &k)
+    {
+        if (data && key == k)
+            return false;
+        key = k;
+        data.reset(static_cast<float *>(
+          std::aligned_alloc(IMAGE_ALIGNMENT, byte_size())));
+        return true;
+    }
+
+    size_t byte_size() const
+    {
+        return size_t(2) * key.grid.ntiles() * key.grid.tile_pixels() *
+               sizeof(float);
+    }
 };
 
-struct Rect
+// A slot in the ring of frames between the render coordinator and the
+// consumers of the frames. Slots cycle Free -> Rendering -> Ready -> Acquired
+// -> Free, a ready frame that is overtaken by a newer one before it was
+// acquired goes straight back to Free.
+struct Frame
 {
-    uint32_t offset; // gets mapped to 2 dim later
-    uint32_t size;
-    Rect(uint32_t _offset, uint32_t _size) : offset(_offset), size(_size) {}
-    Rect() {}
+    enum State
+    {
+        Free,
+        Rendering,
+        Ready,
+        Acquired
+    };
+
+    Image image;
+    State state = Free;
+    // frames are numbered from 1 in render order, or from
+    // Config::first_frame + 1
+    uint64_t id = 0;
+    // animation time in seconds, before Config::time_speed is applied
+    double anim_time = 0;
+    // wall time the coordinator took to render the frame, in seconds
+    double render_time = 0;
 };
 
 struct Transforms
@@ -70,38 +204,156 @@ struct Transforms
 struct Uniforms
 {
     std::vector<float> sincos_table;
+    // the waves the kernels evaluate, see KernelArgs::wave_table
+    std::vector<float> wave_table;
+    uint32_t nsingle = 0;
+    uint32_t npaired = 0;
     std::vector<float> cosine_table;
+    std::vector<float> quarter_table;
+    std::vector<int16_t> quarter_table16;
     double time = 0;
     float rot_omega = 0;
 
     void init(uint32_t nangles, uint32_t ncosines);
 
+    // memory touched by the cosine engine
+    size_t table_bytes(CosineMode mode) const;
+
     uint32_t num_angles() const { return sincos_table.size() / 2; }
 
     uint32_t num_cosines() const { return cosine_table.size() - 1; }
+
+    uint32_t num_quarter_cosines() const { return quarter_table.size() - 2; }
 };
 
+const RenderKernels *
+select_render_kernels(KernelIsa isa);
+
+const char *
+render_stage_name(RenderStage stage);
+
+// the frame rotation is applied to the wave vectors, which are stored in
+// waves; args.wave_table points into it
+KernelArgs
+make_kernel_args(const Config &conf,
+                 const Uniforms &uniforms,
+                 const Transforms &trafos,
+                 std::vector<float> &waves);
+
+// Renders frames on a coordinator thread of its own, which also does the
+// share of worker 0, into a ring of Config::nframes frames. The consumer
+// takes frames either in order (acquire_next) or skips to the newest one
+// (acquire_latest) and hands them back with release().
 struct Renderer
 {
     const Config &conf;
     Uniforms uniforms;
     Transforms trafos;
-    Image images[2];
-    Image *srcImage = nullptr;
-    uint64_t render_version = 0;
-    uint64_t srcVersion = 0;
+    const RenderKernels *kernels = nullptr;
+    TileGrid grid;
 
     std::vector<std::unique_ptr<Worker>> workers;
+    std::unique_ptr<TileScheduler> scheduler;
+    std::unique_ptr<FrameBarrier> frame_barrier;
+    // the cpu of every worker, empty if they are not pinned
+    std::vector<CpuTopology::Cpu> placement;
 
-    Renderer(const Config &conf) : conf(conf) {}
+    // the image of the frame being rendered, published to the workers by the
+    // frame barrier
+    Image *target = nullptr;
+    // steady clock time stamps of the frame being rendered: when the workers
+    // were released and when the last one was done
+    uint64_t frame_start_ns = 0;
+    uint64_t frame_end_ns = 0;
+    // the render size of the window, empty without dynamic resolution
+    std::unique_ptr<ResolutionScaler> scaler;
+
+    // warped world coordinates of every pixel (see KernelArgs::world_coords),
+    // only kept for non affine warps. They depend on the image size and
+    // trafos.inverseWorld, but not on the rotation.
+    PixelCache world_cache;
+    // time independent wave sums of the separable amplitude kernel (see
+    // KernelArgs::wave_sums), these also depend on the rotation
+    PixelCache wave_sums;
+
+    // seconds per frame spent in every RenderStage, see profile_stages()
+    struct StageProfile
+    {
+        uint32_t frames = 0;
+        double seconds[NUM_RENDER_STAGES] = {};
+    };
+
+    // frame barrier overhead summed over the frames since the last
+    // take_barrier_stats(), only collected in verbose mode
+    struct BarrierStats
+    {
+        uint32_t frames = 0;
+        double wake_sum = 0;
+        double wake_max = 0;
+        double done_wait_sum = 0;
+    } barrier_stats;
+
+    // the ring, all fields below are guarded by ring_mutex
+    std::vector<Frame> frames;
+    std::mutex ring_mutex;
+    // signaled whenever a frame changes its state
+    std::condition_variable ring_changed;
+    uint64_t last_acquired = 0;
+    uint32_t frames_skipped = 0;
+    // frames the coordinator did not render because it was too late for
+    // them, see run_coordinator()
+    uint32_t deadlines_missed = 0;
+    bool stopping = false;
+    // the statistics of every rendered frame until take_frame_stats(), the
+    // oldest are dropped beyond MAX_FRAME_STATS
+    std::deque<FrameStats> frame_stats;
+
+    std::thread coordinator;
+
+    Renderer(const Config &conf)
+      : conf(conf), last_acquired(conf.first_frame)
+    {}
 
     bool init();
     bool init_workers();
     void shutdown();
 
+    // called by every worker on its own thread before the first frame
+    void pin_worker(uint32_t id);
+    void first_touch(uint32_t id);
+
+    KernelArgs kernel_args(std::vector<float> &waves) const;
+
+    void set_anim_time(double anim_time);
+    // renders the next frames at w x h pixels of the same view
+    void set_render_size(uint32_t w, uint32_t h);
+    void update_pixel_caches();
     void start_new_frame();
-    void render();
-    bool save_screenshot(const char *path);
+    void render(Frame &frame);
+    FrameStats collect_frame_stats(const Frame &frame) const;
+    void run_coordinator();
+
+    // blocks until the frame after the last acquired one is ready, nullptr
+    // once the renderer is shutting down
+    Frame *acquire_next();
+    // the newest ready frame, older ready frames are dropped. Waits up to
+    // timeout seconds for one, nullptr if there is none by then
+    Frame *acquire_latest(double timeout);
+    void release(Frame *frame);
+
+    // Renders the first nframes frames once more on the calling thread with
+    // the staged kernel, which times every stage. Only after shutdown().
+    StageProfile profile_stages(uint32_t nframes);
+
+    BarrierStats take_barrier_stats();
+    // the statistics of the frames rendered since the last call, in order
+    std::vector<FrameStats> take_frame_stats();
+    // number of frames dropped by acquire_latest() since the last call
+    uint32_t take_frames_skipped();
+    // number of frames skipped by the pacing since the last call
+    uint32_t take_deadlines_missed();
 
     bool is_capture_mode() const { return conf.ncapture > 0; }
+
+    bool is_bench_mode() const { return conf.nbench > 0; }
 };
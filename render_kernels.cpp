@@ -0,0 +1,850 @@
+#include "render_kernels.hpp"
+
+#include "simd_vec.hpp"
+
+#include <x86intrin.h>
+
+#include <cmath>
+#include <type_traits>
+
+#ifndef KERNEL_ISA
+#define KERNEL_ISA sse2
+#endif
+
+#define KERNEL_TABLE_NAME_(isa) render_kernels_##isa
+#define KERNEL_TABLE_NAME(isa) KERNEL_TABLE_NAME_(isa)
+
+struct TableCosine
+{
+    static vecf_t __attribute__((always_inline))
+    eval(const KernelArgs &us, vecf_t t)
+    {
+
+        // union {
+        //     vecf_t::elem_type flat[vecf_t::size];
+        //     vecf_t packed;
+        // } x;
+
+        // x.packed = t;
+        // for (uint32_t i = 0; i < vecf_t::size; ++i)
+        //     x.flat[i] = cosf(x.flat[i]);
+
+        // return x.packed;
+
+        const vecf_t num_cosines = vecf(float(us.ncosines));
+        const vecf_t inv_tau = vecf(float(1.0 / (2.0 * M_PI)));
+
+        t = fract(t * inv_tau);
+        t *= num_cosines;
+
+        veci_t i = veci(t);
+        // veci_t j = i + veci(1);
+        // vecf_t frac = t - vecf(i);
+
+        const vecf_t a = index(us.cosine_table, i);
+        // const vecf_t b = index(us->cosine_table, j);
+
+        return a;
+        // return a + (b - a) * frac;
+    }
+};
+
+// minimax coefficients of sin(2 pi s) = s * P(s^2) on |s| <= 1/4
+template<CosineMode>
+struct PolyCoeffs;
+
+template<>
+struct PolyCoeffs<CosineMode::PolyLow>
+{
+    static constexpr unsigned degree = 5; // |error| <= 1.4e-4
+    static constexpr bool exact_reduction = false;
+    static constexpr float c[] = { 6.2825626138e+00f,
+                                   -4.1154269382e+01f,
+                                   7.4132280983e+01f };
+};
+
+template<>
+struct PolyCoeffs<CosineMode::PolyMedium>
+{
+    static constexpr unsigned degree = 7; // |error| <= 1.5e-6
+    static constexpr bool exact_reduction = true;
+    static constexpr float c[] = { 6.2831829103e+00f,
+                                   -4.1339668813e+01f,
+                                   8.1415520482e+01f,
+                                   -7.1610312251e+01f };
+};
+
+template<>
+struct PolyCoeffs<CosineMode::PolyHigh>
+{
+    static constexpr unsigned degree = 9; // |error| <= 1.2e-8 + rounding
+    static constexpr bool exact_reduction = true;
+    static constexpr float c[] = { 6.2831853019e+00f,
+                                   -4.1341691864e+01f,
+                                   8.1603265729e+01f,
+                                   -7.6598207920e+01f,
+                                   3.9873231779e+01f };
+};
+
+// 2 pi split into a part with few significant bits, so that k * TAU_HI is
+// exact, and the remainder (Cody-Waite reduction)
+const float TAU_HI = 6.28125f;
+const float TAU_LO = float(2 * M_PI - 6.28125);
+
+// maps the angle t to r in [-1/2, 1/2] turns, t = 2 pi (r + k). With Exact
+// set the reduction is done in radians first, t * inv_tau alone loses the low
+// bits of large arguments
+template<bool Exact>
+static vecf_t __attribute__((always_inline))
+reduce_turns(vecf_t t)
+{
+    const vecf_t inv_tau = vecf(float(1.0 / (2.0 * M_PI)));
+
+    vecf_t r = t * inv_tau;
+    const vecf_t k = vecf(veci_round(r));
+    if (Exact)
+        return (t - k * vecf(TAU_HI) - k * vecf(TAU_LO)) * inv_tau;
+    return r - k;
+}
+
+// evaluates cos(t) without touching memory: the argument is reduced to
+// r in [-1/2, 1/2] turns, and cos(2 pi r) = sin(2 pi (1/4 - |r|)) is
+// approximated by an odd polynomial
+template<CosineMode Mode>
+struct PolyCosine
+{
+    typedef PolyCoeffs<Mode> Coeffs;
+    static const unsigned nterms = (Coeffs::degree + 1) / 2;
+
+    static vecf_t __attribute__((always_inline))
+    eval(const KernelArgs &, vecf_t t)
+    {
+        const vecf_t r = reduce_turns<Coeffs::exact_reduction>(t);
+        const vecf_t s = vecf(float(0.25)) - fabs(r);
+        const vecf_t z = s * s;
+
+        vecf_t p = vecf(Coeffs::c[nterms - 1]);
+        for (unsigned k = nterms - 1; k-- > 0;)
+            p = fmadd(p, z, vecf(Coeffs::c[k]));
+
+        return p * s;
+    }
+};
+
+// linear interpolation in a table of cos over a quarter wave, the other
+// quarters follow from cos(pi/2 a) = sign(1 - a) cos(pi/2 (1 - |1 - a|))
+template<bool Int16>
+struct QuarterCosine
+{
+    static vecf_t __attribute__((always_inline))
+    eval(const KernelArgs &us, vecf_t t)
+    {
+        const vecf_t one = vecf(float(1));
+        const vecf_t r = reduce_turns<false>(t);
+
+        const vecf_t a = fabs(r) * vecf(float(4)); // [0, 2] quarter turns
+        const vecf_t b = one - a;
+        const veci_t sign = coerce_veci(b) & veci(0x80000000u);
+
+        const vecf_t x = (one - fabs(b)) * vecf(float(us.nquarter));
+        const veci_t i = veci(x);
+        const vecf_t frac = x - vecf(i);
+
+        vecf_t c0, c1;
+        if (Int16) {
+            // one 32 bit load fetches both neighbours
+            const veci_t pair = index_bytes(us.quarter_table16, i << 1);
+            const vecf_t scale = vecf(float(1 / QUARTER16_ONE));
+            c0 = vecf(srai(pair << 16, 16)) * scale;
+            c1 = vecf(srai(pair, 16)) * scale;
+        } else {
+            c0 = index(us.quarter_table, i);
+            c1 = index(us.quarter_table + 1, i);
+        }
+
+        const vecf_t c = c0 + (c1 - c0) * frac;
+        return coerce_vecf(coerce_veci(c) ^ sign);
+    }
+};
+
+template<typename F>
+static void __attribute__((always_inline))
+with_cosine(CosineMode mode, F &&f)
+{
+    switch (mode) {
+    case CosineMode::Table:
+        f(TableCosine());
+        break;
+    case CosineMode::PolyLow:
+        f(PolyCosine<CosineMode::PolyLow>());
+        break;
+    case CosineMode::PolyMedium:
+        f(PolyCosine<CosineMode::PolyMedium>());
+        break;
+    case CosineMode::PolyHigh:
+        f(PolyCosine<CosineMode::PolyHigh>());
+        break;
+    case CosineMode::Quarter:
+        f(QuarterCosine<false>());
+        break;
+    case CosineMode::Quarter16:
+        f(QuarterCosine<true>());
+        break;
+    }
+}
+
+// world coordinates are produced from the pixel coordinates by pixel_coords
+// and transform_points for n vectors at a time. Both are inlined into the
+// fused kernel, which keeps a block of vectors in registers through all
+// stages, and into the staged kernel, which runs every stage over the whole
+// tile before starting the next one.
+
+// vectors per row of the tile, the last one may reach into the row padding
+static uint32_t __attribute__((always_inline))
+row_vectors(const Rect &rect)
+{
+    return CEIL_DIV(rect.w, vecf_t::size);
+}
+
+// pixel coordinates of n vectors starting at vector k of the tile, the
+// vectors are numbered row by row
+static void __attribute__((always_inline))
+pixel_coords(const Rect &rect,
+             uint32_t k,
+             uint32_t n,
+             vecf_t *RESTRICT x,
+             vecf_t *RESTRICT y)
+{
+    static const float lane_index[16] = { 0, 1, 2,  3,  4,  5,  6,  7,
+                                          8, 9, 10, 11, 12, 13, 14, 15 };
+    static_assert(vecf_t::size <= 16, "lane_index too short");
+
+    const uint32_t nvecs = row_vectors(rect);
+    uint32_t col = k % nvecs;
+    uint32_t py = rect.y + k / nvecs;
+    const vecf_t lanes = vecf(lane_index);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        x[i] = vecf(float(rect.x + col * vecf_t::size)) + lanes;
+        y[i] = vecf(float(py));
+        if (++col == nvecs) {
+            col = 0;
+            ++py;
+        }
+    }
+}
+
+static void __attribute__((always_inline))
+transform_points(const AffineTrafo2 &RESTRICT M,
+                 uint32_t n,
+                 vecf_t *RESTRICT x,
+                 vecf_t *RESTRICT y)
+{
+    const vecf_t x_off = vecf(M.origin.coords.x);
+    const vecf_t y_off = vecf(M.origin.coords.y);
+    const vecf_t m11 = vecf(M.x.x);
+    const vecf_t m12 = vecf(M.y.x);
+    const vecf_t m21 = vecf(M.x.y);
+    const vecf_t m22 = vecf(M.y.y);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        vecf_t vx = x[i];
+        vecf_t vy = y[i];
+        x[i] = vx * m11 + vy * m12 + x_off;
+        y[i] = vx * m21 + vy * m22 + y_off;
+    }
+}
+
+// Uniforms::init folds waves with opposite wave vectors into pairs,
+// cos(t + p) + cos(t - p) = 2 cos(t) cos(p), so only one of them has to be
+// evaluated. The pairs are summed first without the time offset and scaled,
+// then the remaining waves are added. add_wave(wave, t0) has to add
+// cos(t0 + phase) of the wave with the (sin, cos) entry at wave to amp.
+template<typename AddWave>
+static void __attribute__((always_inline))
+sum_waves(const KernelArgs &us,
+          const uint32_t n,
+          vecf_t *RESTRICT amp,
+          AddWave &&add_wave)
+{
+    const vecf_t init_amp = vecf(float(us.nangles));
+    const float *paired = us.wave_table + 2 * us.nsingle;
+
+    if (us.npaired > 0) {
+        for (uint32_t i = 0; i < n; ++i)
+            amp[i] = vecf(float(0));
+
+        for (uint32_t a = 0; a < us.npaired; ++a)
+            add_wave(paired + 2 * a, vecf(float(0)));
+
+        const vecf_t scale = vecf(float(2 * std::cos(double(us.time))));
+        for (uint32_t i = 0; i < n; ++i)
+            amp[i] = amp[i] * scale + init_amp;
+    } else {
+        for (uint32_t i = 0; i < n; ++i)
+            amp[i] = init_amp;
+    }
+
+    const vecf_t time = vecf(us.time);
+
+    for (uint32_t a = 0; a < us.nsingle; ++a)
+        add_wave(us.wave_table + 2 * a, time);
+}
+
+template<typename Cosine>
+static void __attribute__((always_inline))
+calculate_amplitudes(const KernelArgs &us,
+                     const uint32_t n,
+                     const vecf_t *RESTRICT x,
+                     const vecf_t *RESTRICT y,
+                     vecf_t *RESTRICT amp)
+{
+    sum_waves(us, n, amp, [&](const float *wave, const vecf_t t0) {
+        vecf_t scale_y = vecf(wave[0]);
+        vecf_t scale_x = vecf(wave[1]);
+
+        for (uint32_t k = 0; k < n; ++k) {
+            vecf_t t = t0;
+            t += x[k] * scale_x;
+            t += y[k] * scale_y;
+            amp[k] += Cosine::eval(us, t);
+        }
+    });
+}
+
+// maximal run length between two exact evaluations in the recurrence kernel
+const uint32_t RECURRENCE_PERIOD = 16;
+
+// splits the vectors of a tile into runs within a row of at most
+// RECURRENCE_PERIOD vectors, runs[s] is the first vector of run s and
+// runs[nruns] the number of vectors
+static uint32_t
+recurrence_runs(const Rect &rect, uint32_t *runs)
+{
+    const uint32_t nvecs = row_vectors(rect);
+    uint32_t nruns = 0;
+
+    for (uint32_t row = 0; row < rect.h; ++row)
+        for (uint32_t col = 0; col < nvecs; col += RECURRENCE_PERIOD)
+            runs[nruns++] = row * nvecs + col;
+
+    runs[nruns] = rect.h * nvecs;
+    return nruns;
+}
+
+// With an affine warp the phase of a wave is affine in the pixel position, so
+// along a row cos(phase) can be advanced by a complex rotation instead of
+// being evaluated for every pixel. Every run is seeded exactly from the world
+// coordinates (seed_x, seed_y) of its first vector, every following vector of
+// the run is the seed rotated by a multiple of the per vector phase step.
+// Rotating from the seed instead of from the previous vector avoids a loop
+// carried dependency and keeps the error independent of the position in the
+// run.
+static void __attribute__((noinline))
+calculate_amplitudes_recurrence(const KernelArgs &us,
+                                const uint32_t n,
+                                const uint32_t nruns,
+                                const uint32_t *RESTRICT runs,
+                                const vecf_t *RESTRICT seed_x,
+                                const vecf_t *RESTRICT seed_y,
+                                vecf_t *RESTRICT amp)
+{
+    typedef PolyCosine<CosineMode::PolyHigh> Seed;
+
+    const vecf_t quarter_turn = vecf(float(M_PI / 2));
+    const AffineTrafo2 &M = us.pixel_to_world;
+
+    sum_waves(us, n, amp, [&](const float *wave, const vecf_t t0) {
+        float sin_a = wave[0];
+        float cos_a = wave[1];
+        vecf_t scale_y = vecf(sin_a);
+        vecf_t scale_x = vecf(cos_a);
+
+        // rotations by multiples of the phase advance from one vector to
+        // the next
+        vecf_t rot_c[RECURRENCE_PERIOD];
+        vecf_t rot_s[RECURRENCE_PERIOD];
+        {
+            double step =
+              double(vecf_t::size) * (cos_a * M.x.x + sin_a * M.x.y);
+            double c = 1, s = 0;
+            const double step_c = std::cos(step);
+            const double step_s = std::sin(step);
+            for (uint32_t j = 0; j < RECURRENCE_PERIOD; ++j) {
+                rot_c[j] = vecf(float(c));
+                rot_s[j] = vecf(float(s));
+                double c1 = c * step_c - s * step_s;
+                s = c * step_s + s * step_c;
+                c = c1;
+            }
+        }
+
+        for (uint32_t s = 0; s < nruns; ++s) {
+            uint32_t k = runs[s];
+            const uint32_t end = runs[s + 1];
+
+            vecf_t t = t0;
+            t += seed_x[s] * scale_x;
+            t += seed_y[s] * scale_y;
+            const vecf_t c = Seed::eval(us, t);
+            const vecf_t sn = Seed::eval(us, t - quarter_turn);
+
+            for (uint32_t j = 0; k < end; ++k, ++j)
+                amp[k] += c * rot_c[j] - sn * rot_s[j];
+        }
+    });
+}
+
+#if 0
+static float
+fractf(float x)
+{
+    if (x < 0)
+        x = -x;
+    return x - float(int(x));
+}
+
+static vec2
+cart2polar(float x, float y)
+{
+    float r = sqrtf(x * x + y * y);
+    float phi;
+
+    if (r == 0) {
+        phi = 0;
+    } else if (y == 0 && x < 0) {
+        phi = 0.5;
+    } else {
+        phi = atan2f(y, r + x) * (1 / M_PI);
+    }
+
+    phi *= float(2 * M_PI);
+    vec2 v;
+    v.x = phi;
+    v.y = r;
+    return v;
+}
+#endif
+
+// displaces the n vectors of world coordinates by w, see RippleWarp
+static void __attribute__((always_inline))
+ripple_warp(const KernelArgs &us,
+            const RippleWarp &w,
+            uint32_t n,
+            vecf_t *RESTRICT x,
+            vecf_t *RESTRICT y)
+{
+    typedef PolyCosine<CosineMode::PolyMedium> Cosine;
+
+    const vecf_t ex = vecf(w.ex);
+    const vecf_t ey = vecf(w.ey);
+    const vecf_t amplitude = vecf(w.amplitude);
+    const vecf_t freq = vecf(w.freq);
+    // keeps 1 / r finite in the center, the displacement there is bounded by
+    // amplitude * max(1 / ex, 1 / ey) anyway
+    const vecf_t eps = vecf(float(1e-6));
+
+    for (uint32_t i = 0; i < n; ++i) {
+        const vecf_t u = x[i] * ex;
+        const vecf_t v = y[i] * ey;
+        const vecf_t r2 = u * u + v * v + eps;
+        const vecf_t inv_r = rsqrt(r2);
+        const vecf_t r = r2 * inv_r;
+
+        const vecf_t s = vecf(float(1)) +
+                         amplitude * Cosine::eval(us, r * freq) * inv_r;
+        x[i] *= s;
+        y[i] *= s;
+    }
+}
+
+static void __attribute__((always_inline))
+warp_world(const KernelArgs &us,
+           uint32_t n,
+           vecf_t *RESTRICT x,
+           vecf_t *RESTRICT y)
+{
+    switch (us.warp) {
+    case WarpMode::Legacy:
+    case WarpMode::None:
+        break;
+    case WarpMode::Radial:
+        ripple_warp(us, RADIAL_WARP, n, x, y);
+        break;
+    case WarpMode::Anisotropic:
+        ripple_warp(us, ANISOTROPIC_WARP, n, x, y);
+        break;
+    }
+}
+
+// the n vectors of world coordinates starting at vector k of the tile, read
+// from the cache if the renderer keeps one
+static void __attribute__((always_inline))
+world_coords(const KernelArgs &us,
+             const Rect &rect,
+             uint32_t k,
+             uint32_t n,
+             vecf_t *RESTRICT x,
+             vecf_t *RESTRICT y)
+{
+    if (us.world_coords) {
+        const float *cx =
+          us.world_coords + 2 * size_t(rect.index) * us.tile_pixels;
+        const vecf_t *wx = reinterpret_cast<const vecf_t *>(cx) + k;
+        const vecf_t *wy =
+          reinterpret_cast<const vecf_t *>(cx + us.tile_pixels) + k;
+        for (uint32_t i = 0; i < n; ++i) {
+            x[i] = wx[i];
+            y[i] = wy[i];
+        }
+        return;
+    }
+
+    pixel_coords(rect, k, n, x, y);
+    transform_points(us.pixel_to_world, n, x, y);
+    warp_world(us, n, x, y);
+}
+
+static void __attribute__((always_inline))
+shade(uint32_t n, const vecf_t *RESTRICT amp, veci_t *RESTRICT out)
+{
+    const vecf_t max_lum = vecf(float(255));
+
+    for (uint32_t i = 0; i < n; ++i) {
+        vecf_t x = amp[i] * vecf(float(0.5));
+        vecf_t t = fract_positive(x);
+
+        vecf_t lum = t * t * (vecf(3) - vecf(2) * t) * max_lum;
+        out[i] = veci(lum);
+    }
+}
+
+// stores the luminances of n vectors starting at vector k of the tile as
+// bytes
+static void __attribute__((always_inline))
+store_pixels(const Rect &rect,
+             uint32_t stride,
+             uint8_t *pixels,
+             uint32_t k,
+             uint32_t n,
+             const veci_t *RESTRICT colors)
+{
+    dbg_assert(rect.x % TILE_ALIGN == 0 && stride % TILE_ALIGN == 0);
+
+    const uint32_t nvecs = row_vectors(rect);
+    uint32_t col = k % nvecs;
+    uint8_t *row = pixels + size_t(rect.y + k / nvecs) * stride + rect.x;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        store_bytes(row + col * vecf_t::size, colors[i]);
+        if (++col == nvecs) {
+            col = 0;
+            row += stride;
+        }
+    }
+}
+
+// vectors in the largest tile
+const uint32_t TILE_VECS = MAX_TILE_PIXELS / vecf_t::size;
+
+// vectors per block of the fused kernel: the coordinates and amplitudes of a
+// block have to fit into the register file next to the constants of the
+// cosine engine
+const uint32_t FUSED_BLOCK = vecf_t::size == 16 ? 8 : 4;
+
+// calls block(k, m) for consecutive blocks of m vectors covering the n vectors
+// of a tile. m is a compile time constant except for the last, partial
+// block, so the full blocks keep their loops unrolled.
+template<typename Block>
+static void __attribute__((always_inline))
+for_each_block(uint32_t n, Block &&block)
+{
+    uint32_t k = 0;
+    for (; k + FUSED_BLOCK <= n; k += FUSED_BLOCK)
+        block(k, std::integral_constant<uint32_t, FUSED_BLOCK>());
+    if (k < n)
+        block(k, n - k);
+}
+
+static void __attribute__((always_inline))
+recurrence_tile(const KernelArgs &us,
+                const Rect &rect,
+                const vecf_t *RESTRICT x,
+                const vecf_t *RESTRICT y,
+                vecf_t *RESTRICT amp)
+{
+    uint32_t runs[TILE_VECS + 1];
+    vecf_t seed_x[TILE_VECS];
+    vecf_t seed_y[TILE_VECS];
+    const uint32_t nruns = recurrence_runs(rect, runs);
+
+    for (uint32_t s = 0; s < nruns; ++s) {
+        if (x) {
+            seed_x[s] = x[runs[s]];
+            seed_y[s] = y[runs[s]];
+        } else {
+            pixel_coords(rect, runs[s], 1, seed_x + s, seed_y + s);
+            transform_points(us.pixel_to_world, 1, seed_x + s, seed_y + s);
+        }
+    }
+
+    calculate_amplitudes_recurrence(
+      us, runs[nruns], nruns, runs, seed_x, seed_y, amp);
+}
+
+// amplitudes of n vectors starting at vector k of the tile from the
+// precomputed wave sums, see KernelArgs::wave_sums
+static void __attribute__((always_inline))
+separable_amplitudes(const KernelArgs &us,
+                     const Rect &rect,
+                     uint32_t k,
+                     uint32_t n,
+                     vecf_t *RESTRICT amp)
+{
+    const float *cs = us.wave_sums + 2 * size_t(rect.index) * us.tile_pixels;
+    const vecf_t *sum_c = reinterpret_cast<const vecf_t *>(cs) + k;
+    const vecf_t *sum_s =
+      reinterpret_cast<const vecf_t *>(cs + us.tile_pixels) + k;
+
+    const vecf_t init_amp = vecf(float(us.nangles));
+    const vecf_t cos_t = vecf(float(std::cos(double(us.time))));
+    const vecf_t neg_sin_t = vecf(float(-std::sin(double(us.time))));
+
+    for (uint32_t i = 0; i < n; ++i)
+        amp[i] = fmadd(sum_c[i], cos_t, fmadd(sum_s[i], neg_sin_t, init_amp));
+}
+
+// The staged kernel runs every stage over the whole tile before starting the
+// next one, the amplitude pass streams through 3 tile sized arrays once per
+// wave. It is kept as a reference for crystal_bench and times the stages for
+// crystal -B, which is why world_coords is spelled out here.
+template<bool Profile>
+static void __attribute__((always_inline))
+staged_tile(const KernelArgs &us,
+            const Rect &RESTRICT rect,
+            uint32_t stride,
+            uint8_t *pixels,
+            uint64_t *ticks)
+{
+    const uint32_t n = rect.h * row_vectors(rect);
+    vecf_t amp[TILE_VECS];
+    veci_t colors[TILE_VECS];
+
+    uint64_t t = Profile ? __rdtsc() : 0;
+    auto lap = [&](RenderStage stage) {
+        if (Profile) {
+            uint64_t now = __rdtsc();
+            ticks[stage] += now - t;
+            t = now;
+        }
+    };
+
+    if (us.amplitudes == AmplitudeKernel::Separable && us.wave_sums) {
+        separable_amplitudes(us, rect, 0, n, amp);
+        lap(STAGE_AMPLITUDES);
+    } else {
+        vecf_t xcoord[TILE_VECS];
+        vecf_t ycoord[TILE_VECS];
+        if (us.world_coords) {
+            world_coords(us, rect, 0, n, xcoord, ycoord);
+            lap(STAGE_COORDS);
+        } else {
+            pixel_coords(rect, 0, n, xcoord, ycoord);
+            lap(STAGE_COORDS);
+            transform_points(us.pixel_to_world, n, xcoord, ycoord);
+            lap(STAGE_TRANSFORM);
+            warp_world(us, n, xcoord, ycoord);
+            lap(STAGE_WARP);
+        }
+
+        if (us.amplitudes == AmplitudeKernel::Recurrence &&
+            Config::warp_is_affine(us.warp)) {
+            recurrence_tile(us, rect, xcoord, ycoord, amp);
+        } else {
+            with_cosine(us.cosine, [&](auto cosine) {
+                typedef decltype(cosine) Cosine;
+                calculate_amplitudes<Cosine>(us, n, xcoord, ycoord, amp);
+            });
+        }
+        lap(STAGE_AMPLITUDES);
+    }
+
+    shade(n, amp, colors);
+    store_pixels(rect, stride, pixels, 0, n, colors);
+    lap(STAGE_COLOR);
+}
+
+static void __attribute__((noinline))
+draw_crystal_staged(const KernelArgs &us,
+                    const Rect &RESTRICT rect,
+                    uint32_t stride,
+                    uint8_t *pixels)
+{
+    staged_tile<false>(us, rect, stride, pixels, nullptr);
+}
+
+static void __attribute__((noinline))
+profile_tile(const KernelArgs &us,
+             const Rect &RESTRICT rect,
+             uint32_t stride,
+             uint8_t *pixels,
+             uint64_t *ticks)
+{
+    staged_tile<true>(us, rect, stride, pixels, ticks);
+}
+
+// The fused kernel takes blocks of FUSED_BLOCK vectors through all stages
+// (or just amplitudes and colour with cached world coordinates), the block
+// stays in registers and the waves are the inner loop, so nothing but the
+// wave table is reloaded per wave. The recurrence kernel only needs
+// the coordinates of the first vector of every run, it accumulates into a
+// single tile sized array. The separable kernel only streams through the
+// precomputed wave sums.
+static void __attribute__((noinline)) draw_crystal(const KernelArgs &us,
+                                                   const Rect &RESTRICT rect,
+                                                   uint32_t stride,
+                                                   uint8_t *pixels)
+{
+    const uint32_t n = rect.h * row_vectors(rect);
+
+    if (us.amplitudes == AmplitudeKernel::Separable && us.wave_sums) {
+        for_each_block(n, [&](uint32_t k, auto m) {
+            vecf_t amp[FUSED_BLOCK];
+            veci_t colors[FUSED_BLOCK];
+            separable_amplitudes(us, rect, k, m, amp);
+            shade(m, amp, colors);
+            store_pixels(rect, stride, pixels, k, m, colors);
+        });
+        return;
+    }
+
+    if (us.amplitudes == AmplitudeKernel::Recurrence &&
+        Config::warp_is_affine(us.warp)) {
+        vecf_t amp[TILE_VECS];
+        veci_t colors[TILE_VECS];
+        recurrence_tile(us, rect, nullptr, nullptr, amp);
+        shade(n, amp, colors);
+        store_pixels(rect, stride, pixels, 0, n, colors);
+        return;
+    }
+
+    with_cosine(us.cosine, [&](auto cosine) {
+        typedef decltype(cosine) Cosine;
+
+        for_each_block(n, [&](uint32_t k, auto m) {
+            vecf_t x[FUSED_BLOCK];
+            vecf_t y[FUSED_BLOCK];
+            vecf_t amp[FUSED_BLOCK];
+            veci_t colors[FUSED_BLOCK];
+
+            world_coords(us, rect, k, m, x, y);
+            calculate_amplitudes<Cosine>(us, m, x, y, amp);
+            shade(m, amp, colors);
+            store_pixels(rect, stride, pixels, k, m, colors);
+        });
+    });
+}
+
+static void
+warp_tile(const KernelArgs &us, const Rect &rect, float *world)
+{
+    dbg_assert(!us.world_coords);
+    float *cx = world + 2 * size_t(rect.index) * us.tile_pixels;
+    vecf_t *wx = reinterpret_cast<vecf_t *>(cx);
+    vecf_t *wy = reinterpret_cast<vecf_t *>(cx + us.tile_pixels);
+    dbg_assert((uintptr_t) wx % sizeof(vecf_t) == 0);
+
+    for_each_block(rect.h * row_vectors(rect), [&](uint32_t k, auto m) {
+        world_coords(us, rect, k, m, wx + k, wy + k);
+    });
+}
+
+// C and S are computed once per geometry, so they get the accurate cosine
+// regardless of the selected engine
+static void
+wave_sums_tile(const KernelArgs &us, const Rect &rect, float *sums)
+{
+    typedef PolyCosine<CosineMode::PolyHigh> Cosine;
+
+    float *cs = sums + 2 * size_t(rect.index) * us.tile_pixels;
+    vecf_t *sum_c = reinterpret_cast<vecf_t *>(cs);
+    vecf_t *sum_s = reinterpret_cast<vecf_t *>(cs + us.tile_pixels);
+    dbg_assert((uintptr_t) sum_c % sizeof(vecf_t) == 0);
+
+    const float *paired = us.wave_table + 2 * us.nsingle;
+    const vecf_t quarter_turn = vecf(float(M_PI / 2));
+
+    for_each_block(rect.h * row_vectors(rect), [&](uint32_t v, auto m) {
+        vecf_t x[FUSED_BLOCK];
+        vecf_t y[FUSED_BLOCK];
+        vecf_t c[FUSED_BLOCK];
+        vecf_t s[FUSED_BLOCK];
+
+        world_coords(us, rect, v, m, x, y);
+        for (uint32_t k = 0; k < m; ++k)
+            c[k] = s[k] = vecf(float(0));
+
+        // the sines of a pair of opposite waves cancel
+        for (uint32_t a = 0; a < us.npaired; ++a) {
+            vecf_t scale_y = vecf(paired[2 * a]);
+            vecf_t scale_x = vecf(paired[2 * a + 1]);
+            for (uint32_t k = 0; k < m; ++k) {
+                vecf_t t = x[k] * scale_x;
+                t += y[k] * scale_y;
+                c[k] += Cosine::eval(us, t);
+            }
+        }
+
+        for (uint32_t k = 0; k < m; ++k)
+            c[k] *= vecf(float(2));
+
+        for (uint32_t a = 0; a < us.nsingle; ++a) {
+            vecf_t scale_y = vecf(us.wave_table[2 * a]);
+            vecf_t scale_x = vecf(us.wave_table[2 * a + 1]);
+            for (uint32_t k = 0; k < m; ++k) {
+                vecf_t t = x[k] * scale_x;
+                t += y[k] * scale_y;
+                c[k] += Cosine::eval(us, t);
+                s[k] += Cosine::eval(us, t - quarter_turn);
+            }
+        }
+
+        for (uint32_t k = 0; k < m; ++k) {
+            sum_c[v + k] = c[k];
+            sum_s[v + k] = s[k];
+        }
+    });
+}
+
+static void
+eval_cosines(const KernelArgs &us, uint32_t n, const float *t, float *out)
+{
+    with_cosine(us.cosine, [&](auto cosine) {
+        typedef decltype(cosine) Cosine;
+        union
+        {
+            vecf_t::elem_type flat[vecf_t::size];
+            vecf_t packed;
+        } x;
+
+        for (uint32_t i = 0; i < n; i += vecf_t::size) {
+            uint32_t m = n - i < vecf_t::size ? n - i : vecf_t::size;
+            for (uint32_t j = 0; j < vecf_t::size; ++j)
+                x.flat[j] = j < m ? t[i + j] : 0.f;
+            x.packed = Cosine::eval(us, x.packed);
+            for (uint32_t j = 0; j < m; ++j)
+                out[i + j] = x.flat[j];
+        }
+    });
+}
+
+extern const RenderKernels KERNEL_TABLE_NAME(KERNEL_ISA) = {
+    SIMD_ISA_NAME,
+    vecf_t::size,
+    draw_crystal,
+    draw_crystal_staged,
+    profile_tile,
+    warp_tile,
+    wave_sums_tile,
+    eval_cosines,
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "Config.hpp"
+#include "defs.hpp"
+#include "euclidean2d.hpp"
+
+#include <cstdint>
+
+// Interface between the renderer and the pixel kernels. render_kernels.cpp is
+// compiled once per supported instruction set (see CMakeLists.txt) and each
+// build exports one RenderKernels table. Keep everything the kernels see plain
+// data: inline functions shared with the generic code (std containers,
+// algorithms) would otherwise be emitted with AVX encodings, and the linker is
+// free to pick that copy for the baseline code path.
+
+// tiles start at multiples of TILE_ALIGN pixels in x and image rows are
+// padded to a multiple of it, so every row of a tile is a whole number of
+// aligned vectors of the widest backend. Ragged right edges are rendered into
+// the row padding, ragged bottom edges just have fewer rows.
+const uint32_t TILE_ALIGN = 16;
+
+// largest tile in pixels, the kernels keep per tile arrays on the stack
+const uint32_t MAX_TILE_PIXELS = 8192;
+
+// fixed point scale of the int16 quarter wave table
+const float QUARTER16_ONE = 32767;
+
+// a tile: w x h pixels with the top left corner at (x, y), clipped to the
+// image. index numbers the tiles, it locates the tile in the per tile caches.
+struct Rect
+{
+    uint32_t x, y;
+    uint32_t w, h;
+    uint32_t index;
+};
+
+// The non affine warps displace every world point along its radius by
+// amplitude * cos(freq * r). The anisotropic warp measures r in an elliptic
+// metric (x scaled by ex, y by ey), which stretches the ripples along one
+// axis. The legacy warp is affine and folded into KernelArgs::pixel_to_world
+// by the renderer, so like none it costs nothing in the kernels.
+struct RippleWarp
+{
+    float ex, ey;
+    float amplitude;
+    float freq;
+};
+
+const RippleWarp RADIAL_WARP = { 1, 1, 2.5f, 0.2f };
+const RippleWarp ANISOTROPIC_WARP = { 0.35f, 1, 2.5f, 0.2f };
+
+struct KernelArgs
+{
+    // (sin, cos) per evaluated wave: nsingle waves followed by npaired
+    // representatives of pairs of opposite waves
+    const float *wave_table;
+    const float *cosine_table; // ncosines + 1 entries, last one wraps around
+    const float *quarter_table; // cos over [0, pi/2], nquarter + 2 entries
+    const int16_t *quarter_table16; // same, scaled by QUARTER16_ONE
+    uint32_t nangles; // number of waves, including both waves of a pair
+    uint32_t nsingle;
+    uint32_t npaired;
+    uint32_t ncosines;
+    uint32_t nquarter;
+    float time;
+    CosineMode cosine;
+    WarpMode warp;
+    AmplitudeKernel amplitudes;
+    // maps pixels to world coordinates before the warp, the frame rotation
+    // is applied to the wave vectors instead
+    AffineTrafo2 pixel_to_world;
+    // pixels of a full tile, a multiple of TILE_ALIGN
+    uint32_t tile_pixels;
+    // null, or the warped world coordinates of every pixel as written by
+    // RenderKernels::warp_tile: at 2 * rect.index * tile_pixels, tile_pixels
+    // x coordinates followed by tile_pixels y coordinates. The tile is
+    // stored row by row, every row rounded up to whole vectors.
+    const float *world_coords;
+    // null, or the per pixel sums C = sum cos(phase), S = sum sin(phase) of
+    // the waves without time offset, in the same layout as written by
+    // RenderKernels::wave_sums_tile. The amplitude is then
+    // nangles + cos(time) C - sin(time) S.
+    const float *wave_sums;
+};
+
+// the stages timed by RenderKernels::profile_tile
+enum RenderStage
+{
+    STAGE_COORDS, // pixel coordinates, or reading cached world coordinates
+    STAGE_TRANSFORM, // pixel to world transform
+    STAGE_WARP,
+    STAGE_AMPLITUDES,
+    STAGE_COLOR, // shading and storing the bytes
+    NUM_RENDER_STAGES
+};
+
+struct RenderKernels
+{
+    const char *isa;
+    uint32_t lanes;
+
+    // pixels are 8 bit luminances, stride is the distance between image rows
+    // in pixels, a multiple of TILE_ALIGN
+    void (*draw_tile)(const KernelArgs &args,
+                      const Rect &rect,
+                      uint32_t stride,
+                      uint8_t *pixels);
+
+    // same result as draw_tile, but every stage makes a pass over the whole
+    // tile: only used to compare against in crystal_bench
+    void (*draw_tile_staged)(const KernelArgs &args,
+                             const Rect &rect,
+                             uint32_t stride,
+                             uint8_t *pixels);
+
+    // draw_tile_staged, adding the time stamp counter ticks spent in every
+    // stage to ticks[RenderStage]
+    void (*profile_tile)(const KernelArgs &args,
+                         const Rect &rect,
+                         uint32_t stride,
+                         uint8_t *pixels,
+                         uint64_t *ticks);
+
+    // stores the warped world coordinates of the tile in world, see
+    // KernelArgs::world_coords
+    void (*warp_tile)(const KernelArgs &args, const Rect &rect, float *world);
+
+    // stores C and S of the tile in sums, see KernelArgs::wave_sums
+    void (*wave_sums_tile)(const KernelArgs &args,
+                           const Rect &rect,
+                           float *sums);
+
+    // evaluates cos(t[i]) with the cosine engine selected in args
+    void (*eval_cosines)(const KernelArgs &args,
+                         uint32_t n,
+                         const float *t,
+                         float *out);
+};
+
+extern const RenderKernels render_kernels_sse2;
+extern const RenderKernels render_kernels_avx2;
+extern const RenderKernels render_kernels_avx512;
@@ -0,0 +1,63 @@
+#include "resolution.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// share of the frame time a frame may take to render, the rest is left to
+// presenting it and to the jitter of the render time
+const double BUDGET_SHARE = 0.85;
+// a larger size has to be predicted to take less than this share of the
+// budget before the scaler steps up to it, so it does not step right back
+const double RAISE_SHARE = 0.75;
+// weight of the newest frame in the average render time per pixel
+const double COST_WEIGHT = 0.25;
+const uint32_t SCALE_STEPS = 8;
+
+ResolutionScaler::ResolutionScaler(uint32_t w,
+                                   uint32_t h,
+                                   uint32_t min_percent,
+                                   uint32_t fps)
+  : _budget(BUDGET_SHARE / fps), _raise_frames(fps)
+{
+    const double min_scale = min_percent * 0.01;
+    for (uint32_t i = 0;; ++i) {
+        double scale = std::max(1 - double(i) / SCALE_STEPS, min_scale);
+        _sizes.push_back(
+          { std::max(uint32_t(std::lround(w * scale)), 1u),
+            std::max(uint32_t(std::lround(h * scale)), 1u) });
+        if (scale <= min_scale)
+            break;
+    }
+}
+
+bool
+ResolutionScaler::update(double render_time)
+{
+    if (_settling) {
+        _settling = false;
+        return false;
+    }
+
+    const double cost = render_time / _sizes[_level].pixels();
+    _cost = _cost == 0 ? cost : _cost + COST_WEIGHT * (cost - _cost);
+
+    uint32_t level = _level;
+    if (predict(level) > _budget) {
+        while (level + 1 < _sizes.size() && predict(level) > _budget)
+            ++level;
+        _headroom_frames = 0;
+    } else if (level > 0 && predict(level - 1) < RAISE_SHARE * _budget) {
+        if (++_headroom_frames >= _raise_frames) {
+            --level;
+            _headroom_frames = 0;
+        }
+    } else {
+        _headroom_frames = 0;
+    }
+
+    if (level == _level)
+        return false;
+    _level = level;
+    _settling = true;
+    return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Picks the size frames are rendered at so that they fit into the frame
+// time. The sizes step down from the full size in eighths of its width and
+// height to min_percent of it. The render time per pixel is averaged over
+// the last frames: once the predicted time of the current size exceeds the
+// budget the scaler drops to the largest size predicted to fit, and it steps
+// up again after a second of frames with enough headroom for the next larger
+// size.
+class ResolutionScaler
+{
+public:
+    ResolutionScaler(uint32_t w,
+                     uint32_t h,
+                     uint32_t min_percent,
+                     uint32_t fps);
+
+    // the size of the next frame
+    uint32_t width() const { return _sizes[_level].w; }
+    uint32_t height() const { return _sizes[_level].h; }
+
+    // takes the render time of a frame of width() x height() pixels in
+    // seconds, returns true if the next frame has another size
+    bool update(double render_time);
+
+private:
+    struct Size
+    {
+        uint32_t w, h;
+
+        double pixels() const { return double(w) * h; }
+    };
+
+    double predict(uint32_t level) const
+    {
+        return _cost * _sizes[level].pixels();
+    }
+
+    // the full size first
+    std::vector<Size> _sizes;
+    uint32_t _level = 0;
+    const double _budget;
+    const uint32_t _raise_frames;
+    // seconds per pixel, 0 until the first frame
+    double _cost = 0;
+    // frames in a row the next larger size was predicted to fit
+    uint32_t _headroom_frames = 0;
+    // the first frame of a new size also refills the pixel caches, its time
+    // is not representative
+    bool _settling = false;
+};
@@ -0,0 +1,176 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+
+TileScheduler::TileScheduler(SchedPolicy policy,
+                             uint32_t nworkers,
+                             const std::vector<uint32_t> &nodes)
+  : _policy(policy)
+  , _nworkers(nworkers)
+  , _deques(new Deque[nworkers])
+  , _counters(new Counters[nworkers]())
+  , _victims(new uint32_t[nworkers * (nworkers - 1)])
+  , _nlocal(new uint32_t[nworkers])
+{
+    for (uint32_t i = 0; i < nworkers; ++i) {
+        _deques[i].top.store(0, std::memory_order_relaxed);
+        _deques[i].bottom.store(0, std::memory_order_relaxed);
+        _deques[i].last = 0;
+        _deques[i].rng = 0x9E3779B9u * (i + 1) | 1;
+    }
+    _next_tile.store(0, std::memory_order_relaxed);
+
+    // victims on the same node first, each group starting with the next
+    // worker, whose tiles are the closest
+    auto node = [&](uint32_t i) { return nodes.empty() ? 0 : nodes[i]; };
+    for (uint32_t i = 0; i < nworkers; ++i) {
+        uint32_t *victims = &_victims[i * (nworkers - 1)];
+        for (uint32_t k = 1; k < nworkers; ++k)
+            victims[k - 1] = (i + k) % nworkers;
+        uint32_t *remote =
+          std::stable_partition(victims, victims + nworkers - 1, [&](auto v) {
+              return node(v) == node(i);
+          });
+        _nlocal[i] = uint32_t(remote - victims);
+    }
+}
+
+void
+TileScheduler::slice(uint32_t ntiles,
+                     uint32_t nworkers,
+                     uint32_t i,
+                     uint32_t &first,
+                     uint32_t &count)
+{
+    uint32_t size = ntiles / nworkers;
+    uint32_t rest = ntiles % nworkers;
+    uint32_t nsmall = nworkers - rest;
+    count = i >= nsmall ? size + 1 : size;
+    first = i * size + (i >= nsmall ? i - nsmall : 0);
+}
+
+void
+TileScheduler::start_frame(uint32_t ntiles)
+{
+    for (uint32_t i = 0; i < _nworkers; ++i) {
+        uint32_t first, count;
+        slice(ntiles, _nworkers, i, first, count);
+        Deque &d = _deques[i];
+        d.last = first + count - 1;
+        d.top.store(0, std::memory_order_relaxed);
+        d.bottom.store(count, std::memory_order_relaxed);
+        _counters[i] = Counters();
+    }
+
+    _ntiles = ntiles;
+    _next_tile.store(0, std::memory_order_relaxed);
+}
+
+bool
+TileScheduler::pop(Deque &d, uint32_t &tile)
+{
+    int64_t b = d.bottom.load(std::memory_order_relaxed) - 1;
+    d.bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = d.top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        d.bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    tile = d.last - uint32_t(b);
+    if (t < b)
+        return true;
+
+    // the last tile, race against the thieves for it
+    bool won = d.top.compare_exchange_strong(
+      t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    d.bottom.store(b + 1, std::memory_order_relaxed);
+    return won;
+}
+
+TileScheduler::StealResult
+TileScheduler::steal(Deque &d, uint32_t &tile)
+{
+    int64_t t = d.top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = d.bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return Empty;
+
+    uint32_t x = d.last - uint32_t(t);
+    if (!d.top.compare_exchange_strong(
+          t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return Abort;
+
+    tile = x;
+    return Stolen;
+}
+
+// A few random victims first, from the own node if it has other workers,
+// then one sweep over all of them, local ones first. No tiles are added
+// during a frame, so once the sweep found every deque empty the frame is
+// done for this worker.
+bool
+TileScheduler::steal_any(uint32_t id, uint32_t &tile)
+{
+    const uint32_t n = _nworkers;
+    if (n == 1)
+        return false;
+
+    const uint32_t *victims = &_victims[id * (n - 1)];
+    const uint32_t ncandidates = _nlocal[id] > 0 ? _nlocal[id] : n - 1;
+    Counters &counters = _counters[id];
+
+    uint32_t &rng = _deques[id].rng;
+    for (uint32_t attempt = 0; attempt < n; ++attempt) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        uint32_t victim = victims[rng % ncandidates];
+        if (steal(_deques[victim], tile) == Stolen) {
+            ++counters.stolen;
+            return true;
+        }
+        ++counters.failed_steals;
+    }
+
+    for (uint32_t k = 0; k < n - 1; ++k) {
+        StealResult r;
+        while ((r = steal(_deques[victims[k]], tile)) == Abort)
+            ++counters.failed_steals;
+        if (r == Stolen) {
+            ++counters.stolen;
+            return true;
+        }
+        ++counters.failed_steals;
+    }
+
+    return false;
+}
+
+bool
+TileScheduler::next_tile(uint32_t id, uint32_t &tile)
+{
+    bool found = false;
+    switch (_policy) {
+    case SchedPolicy::Steal:
+        found = pop(_deques[id], tile) || steal_any(id, tile);
+        break;
+    case SchedPolicy::Counter: {
+        uint32_t t = _next_tile.fetch_add(1, std::memory_order_relaxed);
+        found = t < _ntiles;
+        if (found)
+            tile = t;
+        break;
+    }
+    case SchedPolicy::Static:
+        found = pop(_deques[id], tile);
+        break;
+    }
+    if (found)
+        ++_counters[id].tiles;
+    return found;
+}
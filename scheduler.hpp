@@ -0,0 +1,92 @@
+#pragma once
+
+#include "Config.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Hands out the tiles of a frame to the workers without locks. start_frame()
+// is called while all workers are idle, the barrier that starts the frame
+// publishes it. Every policy first splits the tiles into one contiguous slice
+// per worker, like the renderer always did:
+//
+//   steal:   every slice is a Chase-Lev deque, the owner takes tiles in
+//            order from the bottom, idle workers steal from the top of
+//            random victims on their own NUMA node before the others
+//   counter: the slices are ignored, all workers share one atomic counter
+//   static:  every worker renders just its own slice
+class TileScheduler
+{
+public:
+    // nodes holds the NUMA node of every worker, or is empty if unknown
+    TileScheduler(SchedPolicy policy,
+                  uint32_t nworkers,
+                  const std::vector<uint32_t> &nodes = {});
+
+    SchedPolicy policy() const { return _policy; }
+    uint32_t nworkers() const { return _nworkers; }
+
+    void start_frame(uint32_t ntiles);
+
+    // the slice of worker i: count tiles starting at tile first. The memory
+    // of a slice is first touched by its worker, so it stays the same for
+    // every frame of a given size.
+    static void slice(uint32_t ntiles,
+                      uint32_t nworkers,
+                      uint32_t i,
+                      uint32_t &first,
+                      uint32_t &count);
+
+    // the next tile for worker id, false once there is no work left for it
+    bool next_tile(uint32_t id, uint32_t &tile);
+
+    // what worker id got from next_tile() since the frame started, only
+    // written by the worker itself
+    struct alignas(64) Counters
+    {
+        uint32_t tiles;
+        uint32_t stolen;
+        // steal attempts that found a deque empty or lost the race for it
+        uint32_t failed_steals;
+    };
+
+    const Counters &counters(uint32_t id) const { return _counters[id]; }
+
+private:
+    // Chase-Lev deque over the tiles of one slice. No tiles are pushed
+    // while a frame is running, so the buffer is implicit: index i holds
+    // tile last - i, the owner pops from the bottom (the first tile of the
+    // slice) and thieves take the highest tiles from the top.
+    struct alignas(64) Deque
+    {
+        std::atomic<int64_t> top;
+        std::atomic<int64_t> bottom;
+        uint32_t last;
+        // xorshift state for picking victims, only used by the owner
+        uint32_t rng;
+    };
+
+    enum StealResult
+    {
+        Stolen,
+        Empty,
+        Abort
+    };
+
+    bool pop(Deque &d, uint32_t &tile);
+    StealResult steal(Deque &d, uint32_t &tile);
+    bool steal_any(uint32_t id, uint32_t &tile);
+
+    const SchedPolicy _policy;
+    const uint32_t _nworkers;
+    std::unique_ptr<Deque[]> _deques;
+    std::unique_ptr<Counters[]> _counters;
+    // the other workers in the order worker i tries to steal from them:
+    // _victims[i * (n - 1) ...], the first _nlocal[i] share its node
+    std::unique_ptr<uint32_t[]> _victims;
+    std::unique_ptr<uint32_t[]> _nlocal;
+    alignas(64) std::atomic<uint32_t> _next_tile;
+    uint32_t _ntiles = 0;
+};
@@ -1,11 +1,32 @@
 #pragma once
 
-#include <emmintrin.h>
+#include <immintrin.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <xmmintrin.h>
+#include <string.h>
+
+// The vector width is picked from the instruction set the translation unit is
+// compiled for: 16 lanes with AVX-512, 8 lanes with AVX2+FMA and 4 lanes with
+// plain SSE2. Every backend lives in its own namespace, so translation units
+// compiled with different -m flags can be linked into the same binary without
+// violating the one definition rule.
+
+#if defined(__AVX512F__)
+#define SIMD_NS simd_avx512
+#define SIMD_ISA_NAME "avx512"
+#define SIMD_WIDTH 16
+#elif defined(__AVX2__) && defined(__FMA__)
+#define SIMD_NS simd_avx2
+#define SIMD_ISA_NAME "avx2"
+#define SIMD_WIDTH 8
+#else
+#define SIMD_NS simd_sse2
+#define SIMD_ISA_NAME "sse2"
+#define SIMD_WIDTH 4
+#endif
 
-#ifdef USE_SSE4
-#include <smmintrin.h>
+#if defined(__SSE4_1__) && !defined(USE_SSE4)
+#define USE_SSE4
 #endif
 
 #ifdef USE_SSE4
@@ -16,8 +37,47 @@
 #define NO_SSE4(...) __VA_ARGS__
 #endif
 
-typedef __m128 vec4f_data __attribute__((aligned(16)));
-typedef __m128i vec4i_data __attribute__((aligned(16)));
+#if SIMD_WIDTH == 16
+#define SIMD_PS(op) _mm512_##op##_ps
+#define SIMD_EPI32(op) _mm512_##op##_epi32
+#define SIMD_OR_SI _mm512_or_si512
+#define SIMD_CVTTPS_EPI32 _mm512_cvttps_epi32
+#define SIMD_CVTPS_EPI32 _mm512_cvtps_epi32
+#define SIMD_AND_SI _mm512_and_si512
+#define SIMD_XOR_SI _mm512_xor_si512
+#define SIMD_RSQRT_PS _mm512_rsqrt14_ps
+#elif SIMD_WIDTH == 8
+#define SIMD_PS(op) _mm256_##op##_ps
+#define SIMD_EPI32(op) _mm256_##op##_epi32
+#define SIMD_OR_SI _mm256_or_si256
+#define SIMD_CVTTPS_EPI32 _mm256_cvttps_epi32
+#define SIMD_CVTPS_EPI32 _mm256_cvtps_epi32
+#define SIMD_AND_SI _mm256_and_si256
+#define SIMD_XOR_SI _mm256_xor_si256
+#define SIMD_RSQRT_PS _mm256_rsqrt_ps
+#else
+#define SIMD_PS(op) _mm_##op##_ps
+#define SIMD_EPI32(op) _mm_##op##_epi32
+#define SIMD_OR_SI _mm_or_si128
+#define SIMD_CVTTPS_EPI32 _mm_cvttps_epi32
+#define SIMD_CVTPS_EPI32 _mm_cvtps_epi32
+#define SIMD_AND_SI _mm_and_si128
+#define SIMD_XOR_SI _mm_xor_si128
+#define SIMD_RSQRT_PS _mm_rsqrt_ps
+#endif
+
+namespace SIMD_NS {
+
+#if SIMD_WIDTH == 16
+typedef __m512 vecf_data __attribute__((aligned(64)));
+typedef __m512i veci_data __attribute__((aligned(64)));
+#elif SIMD_WIDTH == 8
+typedef __m256 vecf_data __attribute__((aligned(32)));
+typedef __m256i veci_data __attribute__((aligned(32)));
+#else
+typedef __m128 vecf_data __attribute__((aligned(16)));
+typedef __m128i veci_data __attribute__((aligned(16)));
+#endif
 
 struct vecf_t;
 struct veci_t;
@@ -26,12 +86,12 @@ inline vecf_t
 vecf(float);
 inline vecf_t
 vecf(const float *);
-inline vecf_t vecf(vec4f_data);
+inline vecf_t vecf(vecf_data);
 inline vecf_t vecf(veci_t);
 
 inline veci_t
 veci(unsigned);
-inline veci_t veci(vec4i_data);
+inline veci_t veci(veci_data);
 inline veci_t veci(vecf_t);
 
 #define ARG_VEC(arg) (arg).packed
@@ -57,19 +117,19 @@ inline veci_t veci(vecf_t);
 
 struct vecf_t
 {
-    vec4f_data packed;
+    vecf_data packed;
 
     typedef float elem_type;
-    static const unsigned size = 4;
-    static const unsigned alignment = 16;
+    static const unsigned size = SIMD_WIDTH;
+    static const unsigned alignment = sizeof(vecf_data);
 
-    DEF_VECF_OP(+, _mm_add_ps)
-    DEF_VECF_OP(-, _mm_sub_ps)
-    DEF_VECF_OP(*, _mm_mul_ps)
+    DEF_VECF_OP(+, SIMD_PS(add))
+    DEF_VECF_OP(-, SIMD_PS(sub))
+    DEF_VECF_OP(*, SIMD_PS(mul))
 
-    DEF_VECF_SET_OP(+=, _mm_add_ps)
-    DEF_VECF_SET_OP(-=, _mm_sub_ps)
-    DEF_VECF_SET_OP(*=, _mm_mul_ps)
+    DEF_VECF_SET_OP(+=, SIMD_PS(add))
+    DEF_VECF_SET_OP(-=, SIMD_PS(sub))
+    DEF_VECF_SET_OP(*=, SIMD_PS(mul))
 };
 
 #undef DEF_VECF_OP
@@ -81,102 +141,45 @@ struct vecf_t
     DEF_VEC_SET_OP(veci_t, veci_t, op, ARG_VEC, func)
 
 inline unsigned __attribute__((always_inline))
-vec4i_get_gen(vec4i_data v, int i)
+veci_get(veci_data v, int i)
 {
     union
     {
-        vec4i_data v;
-        unsigned f[4];
+        veci_data v;
+        unsigned f[SIMD_WIDTH];
     } x;
 
     x.v = v;
     return x.f[i];
 }
 
-inline unsigned __attribute__((always_inline)) vec4i_first(vec4i_data v)
-{
-    union
-    {
-        float f;
-        unsigned i;
-    } x;
-
-    _mm_store_ss(&x.f, (vec4f_data) v);
-    return x.i;
-}
-
-#ifndef USE_SSE4
-
-inline unsigned __attribute__((always_inline)) vec4i_get(vec4i_data v, int i)
-{
-    //     if (__builtin_constant_p(i)) {
-
-    //         char foo[i >= 0 && i < 4 ? 1 : -1];
-    //         ((void) foo);
-
-    //         if (i == 0)
-    //             return vec4i_first(v);
-    //         else if (i == 1)
-    //             return vec4i_first(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 1, 1,
-    //             1)));
-    //         else if (i == 2)
-    // //            return vec4i_first((vec4i_data) _mm_movehl_ps((vec4f_data)
-    // v, (vec4f_data) v));
-    //             return vec4i_first(_mm_unpackhi_epi32(v, v));
-    //         else
-    //             return vec4i_first(_mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3,
-    //             3)));
-    //     }
-
-    return vec4i_get_gen(v, i);
-}
-
-#else
-
-inline unsigned __attribute__((always_inline)) vec4i_get(vec4i_data v, int i)
-{
-    // if (__builtin_constant_p(i)) {
-    //     char foo[i >= 0 && i < 4 ? 1 : -1];
-    //     ((void) foo);
-
-    //     if (i == 0)
-    //         return vec4i_first(v);
-    //     else if (i == 1)
-    //         return unsigned(_mm_extract_epi32(v, 1));
-    //     else if (i == 2)
-    //         return unsigned(_mm_extract_epi32(v, 2));
-    //     else
-    //         return unsigned(_mm_extract_epi32(v, 3));
-    // }
-
-    return vec4i_get_gen(v, i);
-}
-
-#endif
-
 struct veci_t
 {
-    vec4i_data packed;
+    veci_data packed;
 
     typedef unsigned elem_type;
-    static const unsigned size = 4;
-    static const unsigned alignment = 16;
-
-    DEF_VECI_OP(+, _mm_add_epi32)
-    DEF_VECI_OP(-, _mm_sub_epi32)
-    DEF_VEC_OP(veci_t, int, veci, >>, ARG, _mm_srli_epi32)
-    DEF_VEC_OP(veci_t, int, veci, <<, ARG, _mm_slli_epi32)
-    DEF_VECI_OP(|, _mm_or_si128)
-
-    DEF_VECI_SET_OP(+=, _mm_add_epi32)
-    DEF_VECI_SET_OP(-=, _mm_sub_epi32)
-    DEF_VEC_SET_OP(veci_t, int, >>=, ARG, _mm_srli_epi32)
-    DEF_VEC_SET_OP(veci_t, int, <<=, ARG, _mm_slli_epi32)
-    DEF_VECI_SET_OP(|=, _mm_or_si128)
+    static const unsigned size = SIMD_WIDTH;
+    static const unsigned alignment = sizeof(veci_data);
+
+    DEF_VECI_OP(+, SIMD_EPI32(add))
+    DEF_VECI_OP(-, SIMD_EPI32(sub))
+    DEF_VEC_OP(veci_t, int, veci, >>, ARG, SIMD_EPI32(srli))
+    DEF_VEC_OP(veci_t, int, veci, <<, ARG, SIMD_EPI32(slli))
+    DEF_VECI_OP(|, SIMD_OR_SI)
+    DEF_VECI_OP(&, SIMD_AND_SI)
+    DEF_VECI_OP(^, SIMD_XOR_SI)
+
+    DEF_VECI_SET_OP(+=, SIMD_EPI32(add))
+    DEF_VECI_SET_OP(-=, SIMD_EPI32(sub))
+    DEF_VEC_SET_OP(veci_t, int, >>=, ARG, SIMD_EPI32(srli))
+    DEF_VEC_SET_OP(veci_t, int, <<=, ARG, SIMD_EPI32(slli))
+    DEF_VECI_SET_OP(|=, SIMD_OR_SI)
+    DEF_VECI_SET_OP(&=, SIMD_AND_SI)
+    DEF_VECI_SET_OP(^=, SIMD_XOR_SI)
 
     elem_type __attribute__((always_inline)) operator[](unsigned i) const
     {
-        return vec4i_get(packed, i);
+        return veci_get(packed, i);
     }
 };
 
@@ -189,18 +192,17 @@ struct veci_t
 inline vecf_t
 vecf(float x)
 {
-    return vecf(_mm_set1_ps(x));
+    return vecf(SIMD_PS(set1)(x));
 }
 
 inline vecf_t
 vecf(const float *data)
 {
-    vecf_t v = { { data[0], data[1], data[2], data[3] } };
-    return v;
+    return vecf(SIMD_PS(loadu)(data));
 }
 
 inline vecf_t
-vecf(vec4f_data p)
+vecf(vecf_data p)
 {
     vecf_t v;
     v.packed = p;
@@ -210,17 +212,17 @@ vecf(vec4f_data p)
 inline vecf_t
 vecf(veci_t i)
 {
-    return vecf(_mm_cvtepi32_ps(i.packed));
+    return vecf(SIMD_PS(cvtepi32)(i.packed));
 }
 
 inline veci_t
 veci(unsigned x)
 {
-    return veci(_mm_set1_epi32(x));
+    return veci(SIMD_EPI32(set1)(x));
 }
 
 inline veci_t
-veci(vec4i_data p)
+veci(veci_data p)
 {
     veci_t v;
     v.packed = p;
@@ -230,17 +232,65 @@ veci(vec4i_data p)
 inline veci_t
 veci(vecf_t f)
 {
-    return veci(_mm_cvttps_epi32(f.packed));
+    return veci(SIMD_CVTTPS_EPI32(f.packed));
+}
+
+// round to nearest, unlike veci(vecf_t) which truncates
+inline veci_t
+veci_round(vecf_t f)
+{
+    return veci(SIMD_CVTPS_EPI32(f.packed));
 }
 
 inline veci_t
 coerce_veci(vecf_t v)
 {
     veci_t u;
-    u.packed = (vec4i_data) v.packed;
+    u.packed = (veci_data) v.packed;
+    return u;
+}
+
+inline vecf_t
+coerce_vecf(veci_t v)
+{
+    vecf_t u;
+    u.packed = (vecf_data) v.packed;
     return u;
 }
 
+// arithmetic shift, operator>> shifts in zeros
+inline veci_t
+srai(veci_t v, int n)
+{
+    return veci(SIMD_EPI32(srai)(v.packed, n));
+}
+
+inline vecf_t
+fabs(vecf_t v)
+{
+    return coerce_vecf(coerce_veci(v) & veci(0x7FFFFFFFu));
+}
+
+// a * b + c, fused where the instruction set has it
+inline vecf_t
+fmadd(vecf_t a, vecf_t b, vecf_t c)
+{
+#if SIMD_WIDTH > 4
+    return vecf(SIMD_PS(fmadd)(a.packed, b.packed, c.packed));
+#else
+    return a * b + c;
+#endif
+}
+
+// 1 / sqrt(v): the hardware estimate (12 or 14 bits) refined by one Newton
+// step
+inline vecf_t
+rsqrt(vecf_t v)
+{
+    const vecf_t e = vecf(SIMD_RSQRT_PS(v.packed));
+    return e * (vecf(float(1.5)) - vecf(float(0.5)) * v * e * e);
+}
+
 // the fractional part of a number, with a minor glitch: the result may also be
 // one
 inline vecf_t
@@ -256,6 +306,54 @@ fract_positive(vecf_t v)
     return v - vecf(veci(v));
 }
 
+// store_bytes() stores the lanes of v, which have to be in [0, 255], as
+// SIMD_WIDTH consecutive bytes at p
+// index_bytes() loads the (unaligned) 32 bit words at base + offset[i]
+
+#if SIMD_WIDTH == 16
+
+inline vecf_t __attribute__((always_inline))
+index(const vecf_t::elem_type *data, const veci_t i)
+{
+    return vecf(_mm512_i32gather_ps(i.packed, data, sizeof *data));
+}
+
+inline void __attribute__((always_inline))
+store_bytes(uint8_t *p, const veci_t v)
+{
+    _mm_storeu_si128((__m128i *) p, _mm512_cvtepi32_epi8(v.packed));
+}
+
+inline veci_t __attribute__((always_inline))
+index_bytes(const void *base, const veci_t offset)
+{
+    return veci(_mm512_i32gather_epi32(offset.packed, base, 1));
+}
+
+#elif SIMD_WIDTH == 8
+
+inline vecf_t __attribute__((always_inline))
+index(const vecf_t::elem_type *data, const veci_t i)
+{
+    return vecf(_mm256_i32gather_ps(data, i.packed, sizeof *data));
+}
+
+inline void __attribute__((always_inline))
+store_bytes(uint8_t *p, const veci_t v)
+{
+    __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(v.packed),
+                                    _mm256_extracti128_si256(v.packed, 1));
+    _mm_storel_epi64((__m128i *) p, _mm_packus_epi16(words, words));
+}
+
+inline veci_t __attribute__((always_inline))
+index_bytes(const void *base, const veci_t offset)
+{
+    return veci(_mm256_i32gather_epi32((const int *) base, offset.packed, 1));
+}
+
+#else
+
 template<typename V, unsigned N = V::size>
 struct IndexVector
 {
@@ -284,3 +382,32 @@ index(const vecf_t::elem_type *data, const veci_t i)
     IndexVector<vecf_t>::index(data, value, i);
     return vecf(value);
 }
+
+inline void __attribute__((always_inline))
+store_bytes(uint8_t *p, const veci_t v)
+{
+    __m128i words = _mm_packs_epi32(v.packed, v.packed);
+    uint32_t bytes =
+      uint32_t(_mm_cvtsi128_si32(_mm_packus_epi16(words, words)));
+    memcpy(p, &bytes, sizeof bytes);
+}
+
+inline veci_t __attribute__((always_inline))
+index_bytes(const void *base, const veci_t offset)
+{
+    union
+    {
+        veci_data v;
+        uint32_t f[SIMD_WIDTH];
+    } x;
+
+    for (unsigned j = 0; j < SIMD_WIDTH; ++j)
+        memcpy(&x.f[j], (const char *) base + offset[j], sizeof x.f[j]);
+    return veci(x.v);
+}
+
+#endif
+
+} // namespace SIMD_NS
+
+using namespace SIMD_NS;
@@ -0,0 +1,217 @@
+#include "topology.hpp"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+
+static bool
+read_uint(const std::string &path, uint32_t &out)
+{
+    FILE *in = fopen(path.c_str(), "r");
+    if (!in)
+        return false;
+    unsigned x;
+    bool ok = fscanf(in, "%u", &x) == 1;
+    fclose(in);
+    if (ok)
+        out = x;
+    return ok;
+}
+
+static uint32_t
+cpu_node(uint32_t cpu)
+{
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+        return 0;
+    uint32_t node = 0;
+    while (dirent *e = readdir(dir)) {
+        unsigned n;
+        if (sscanf(e->d_name, "node%u", &n) == 1) {
+            node = n;
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// parses "max PERIOD" or "QUOTA PERIOD" as found in cgroup v2 cpu.max
+static uint32_t
+parse_cpu_max(const std::string &path)
+{
+    FILE *in = fopen(path.c_str(), "r");
+    if (!in)
+        return 0;
+    char quota[32];
+    unsigned long period = 0;
+    uint32_t ncpus = 0;
+    if (fscanf(in, "%31s %lu", quota, &period) == 2 && period > 0 &&
+        strcmp(quota, "max") != 0)
+        ncpus = uint32_t(std::ceil(double(atol(quota)) / double(period)));
+    fclose(in);
+    return ncpus;
+}
+
+static uint32_t
+cgroup_cpu_quota()
+{
+    // cgroup v2, either our own cgroup or the root of a container
+    std::string cgroup;
+    if (FILE *in = fopen("/proc/self/cgroup", "r")) {
+        char line[512];
+        while (fgets(line, sizeof line, in)) {
+            if (strncmp(line, "0::", 3) == 0) {
+                cgroup = line + 3;
+                while (!cgroup.empty() && cgroup.back() == '\n')
+                    cgroup.pop_back();
+            }
+        }
+        fclose(in);
+    }
+
+    uint32_t ncpus = 0;
+    if (!cgroup.empty() && cgroup != "/")
+        ncpus = parse_cpu_max("/sys/fs/cgroup" + cgroup + "/cpu.max");
+    if (ncpus == 0)
+        ncpus = parse_cpu_max("/sys/fs/cgroup/cpu.max");
+    if (ncpus > 0)
+        return ncpus;
+
+    // cgroup v1, the quota is -1 without a limit
+    uint32_t period;
+    long quota = -1;
+    if (!read_uint("/sys/fs/cgroup/cpu/cpu.cfs_period_us", period) ||
+        period == 0)
+        return 0;
+    if (FILE *in = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) {
+        if (fscanf(in, "%ld", &quota) != 1)
+            quota = -1;
+        fclose(in);
+    }
+    if (quota <= 0)
+        return 0;
+    return uint32_t(std::ceil(double(quota) / double(period)));
+}
+
+CpuTopology
+CpuTopology::detect()
+{
+    CpuTopology topo;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof set, &set) != 0) {
+        topo.cpus.push_back({ 0, 0, 0, 0 });
+        return topo;
+    }
+
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t> core_ids;
+    std::map<uint32_t, bool> nodes;
+    for (uint32_t i = 0; i < CPU_SETSIZE; ++i) {
+        if (!CPU_ISSET(i, &set))
+            continue;
+        std::string dir =
+          "/sys/devices/system/cpu/cpu" + std::to_string(i) + "/topology/";
+        uint32_t core = i, package = 0;
+        read_uint(dir + "core_id", core);
+        read_uint(dir + "physical_package_id", package);
+        auto key = std::make_pair(package, core);
+        auto it = core_ids.emplace(key, uint32_t(core_ids.size())).first;
+
+        Cpu cpu;
+        cpu.id = i;
+        cpu.core = it->second;
+        cpu.package = package;
+        cpu.node = cpu_node(i);
+        nodes[cpu.node] = true;
+        topo.cpus.push_back(cpu);
+    }
+
+    std::sort(topo.cpus.begin(), topo.cpus.end(), [](auto &a, auto &b) {
+        return std::tie(a.node, a.package, a.core, a.id) <
+               std::tie(b.node, b.package, b.core, b.id);
+    });
+
+    topo.nnodes = std::max(uint32_t(nodes.size()), 1u);
+    topo.cpu_quota = cgroup_cpu_quota();
+    return topo;
+}
+
+uint32_t
+CpuTopology::num_cores() const
+{
+    uint32_t n = 0;
+    for (size_t i = 0; i < cpus.size(); ++i)
+        if (i == 0 || cpus[i].core != cpus[i - 1].core)
+            ++n;
+    return n;
+}
+
+uint32_t
+CpuTopology::auto_workers(AffinityPolicy policy) const
+{
+    uint32_t n = policy == AffinityPolicy::Cores ? num_cores()
+                                                 : uint32_t(cpus.size());
+    if (cpu_quota > 0)
+        n = std::min(n, cpu_quota);
+    return std::max(n, 1u);
+}
+
+std::vector<CpuTopology::Cpu>
+CpuTopology::place_workers(uint32_t nworkers, AffinityPolicy policy) const
+{
+    if (policy == AffinityPolicy::None || cpus.empty())
+        return {};
+
+    // rank of every cpu among its SMT siblings and of its core on its node
+    std::vector<uint32_t> sibling(cpus.size()), core_rank(cpus.size());
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        if (i == 0) {
+            sibling[i] = core_rank[i] = 0;
+        } else if (cpus[i].core == cpus[i - 1].core) {
+            sibling[i] = sibling[i - 1] + 1;
+            core_rank[i] = core_rank[i - 1];
+        } else {
+            sibling[i] = 0;
+            core_rank[i] =
+              cpus[i].node == cpus[i - 1].node ? core_rank[i - 1] + 1 : 0;
+        }
+    }
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < cpus.size(); ++i)
+        if (policy != AffinityPolicy::Cores || sibling[i] == 0)
+            order.push_back(i);
+
+    if (policy == AffinityPolicy::Scatter)
+        std::stable_sort(order.begin(), order.end(), [&](auto a, auto b) {
+            return std::tie(sibling[a], core_rank[a], cpus[a].node) <
+                   std::tie(sibling[b], core_rank[b], cpus[b].node);
+        });
+
+    std::vector<Cpu> placement(nworkers);
+    for (uint32_t i = 0; i < nworkers; ++i)
+        placement[i] = cpus[order[i % order.size()]];
+    return placement;
+}
+
+bool
+pin_current_thread(uint32_t cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+}
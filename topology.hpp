@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Config.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// The cpus this process may run on, read from sched_getaffinity (which
+// reflects the cpuset cgroup) and the cpu topology in sysfs.
+struct CpuTopology
+{
+    struct Cpu
+    {
+        uint32_t id;
+        uint32_t core;    // unique over all packages
+        uint32_t package;
+        uint32_t node;    // NUMA node, 0 without NUMA
+    };
+
+    // sorted by node, package, core and cpu id, so SMT siblings are adjacent
+    std::vector<Cpu> cpus;
+    uint32_t nnodes = 1;
+    // cpus worth of time granted by the cpu controller of our cgroup, 0 if
+    // there is no quota
+    uint32_t cpu_quota = 0;
+
+    static CpuTopology detect();
+
+    uint32_t num_cores() const;
+
+    // the worker count for -j auto: one per usable cpu, or per physical core
+    // with the cores policy, capped by the cgroup quota
+    uint32_t auto_workers(AffinityPolicy policy) const;
+
+    // the cpu of every worker, empty for AffinityPolicy::None:
+    //
+    //   compact: fill the cpus of one node after the other, SMT siblings
+    //            before the next core
+    //   scatter: alternate between nodes and then cores, SMT siblings are
+    //            only used once every core has a worker
+    //   cores:   like compact, but one cpu per physical core
+    //
+    // more workers than cpus wrap around.
+    std::vector<Cpu> place_workers(uint32_t nworkers,
+                                   AffinityPolicy policy) const;
+};
+
+// binds the calling thread to cpu, returns false on failure
+bool
+pin_current_thread(uint32_t cpu);
@@ -2,9 +2,16 @@
 
 #include "defs.hpp"
 
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
-#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
 #include <utility>
+#include <vector>
 
 class StopWatch
 {
@@ -29,11 +36,47 @@ StopWatch::now() const
     return double(ns.count()) * 1e-9;
 }
 
-inline void
-sleep(double secs)
+// steady clock time stamp, comparable between threads
+inline uint64_t
+now_ns()
 {
-    if (secs <= 0)
-        return;
     using namespace std::chrono;
-    std::this_thread::sleep_for(duration<double>(secs));
+    return uint64_t(duration_cast<nanoseconds>(
+                      steady_clock::now().time_since_epoch())
+                      .count());
+}
+
+// the last part of a sleep that is spun instead, the timer slack and the
+// scheduler often wake a sleeping thread some 100 us late
+const uint64_t SPIN_TAIL_NS = 200000;
+
+// Sleeps until now_ns() reaches deadline. The deadline is absolute, so time
+// spent between the calls does not add up as it would with relative sleeps.
+// steady_clock is CLOCK_MONOTONIC on Linux.
+inline void
+sleep_until_ns(uint64_t deadline)
+{
+    if (now_ns() + SPIN_TAIL_NS < deadline) {
+        const uint64_t wake = deadline - SPIN_TAIL_NS;
+        timespec ts;
+        ts.tv_sec = time_t(wake / 1000000000);
+        ts.tv_nsec = long(wake % 1000000000);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) ==
+               EINTR)
+            ;
+    }
+    while (now_ns() < deadline)
+        _mm_pause();
+}
+
+// the p-th percentile (0 < p <= 1) of x by the nearest rank, x is reordered
+inline double
+percentile(std::vector<double> &x, double p)
+{
+    if (x.empty())
+        return 0;
+    size_t rank = size_t(std::ceil(p * double(x.size())));
+    auto nth = x.begin() + std::clamp<size_t>(rank, 1, x.size()) - 1;
+    std::nth_element(x.begin(), nth, x.end());
+    return *nth;
 }
@@ -0,0 +1,106 @@
+#include "worker_stats.hpp"
+
+#include "utils.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+WorkerStatsLog::~WorkerStatsLog()
+{
+    if (_csv && fclose(_csv) != 0)
+        fprintf(stderr, "Failed to write the statistics log\n");
+}
+
+bool
+WorkerStatsLog::open_csv(const std::string &path)
+{
+    _csv = fopen(path.c_str(), "w");
+    if (!_csv) {
+        fprintf(
+          stderr, "Failed to open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(_csv,
+            "frame,render_ms,worker,tiles,stolen,failed_steals,"
+            "start_wait_us,busy_ms,done_wait_ms\n");
+    return true;
+}
+
+void
+WorkerStatsLog::add(const FrameStats &frame)
+{
+    if (_csv) {
+        for (size_t i = 0; i < frame.workers.size(); ++i) {
+            const WorkerFrameStats &w = frame.workers[i];
+            fprintf(_csv,
+                    "%llu,%.4f,%u,%u,%u,%u,%.2f,%.4f,%.4f\n",
+                    (unsigned long long) frame.id,
+                    frame.render_time * 1e3,
+                    unsigned(i),
+                    unsigned(w.tiles),
+                    unsigned(w.stolen),
+                    unsigned(w.failed_steals),
+                    w.start_wait * 1e6,
+                    w.busy * 1e3,
+                    w.done_wait * 1e3);
+        }
+    }
+
+    _window.push_back(frame);
+    if (_window.size() > _window_size)
+        _window.pop_front();
+}
+
+void
+WorkerStatsLog::print(FILE *out) const
+{
+    if (_window.empty())
+        return;
+
+    struct Column
+    {
+        const char *name;
+        const char *format;
+        double (*value)(const WorkerFrameStats &);
+    };
+    static const Column columns[] = {
+        { "tiles", "%.0f/%.0f", [](auto &w) { return double(w.tiles); } },
+        { "stolen", "%.0f/%.0f", [](auto &w) { return double(w.stolen); } },
+        { "failed steals",
+          "%.0f/%.0f",
+          [](auto &w) { return double(w.failed_steals); } },
+        { "start wait us",
+          "%.1f/%.1f",
+          [](auto &w) { return w.start_wait * 1e6; } },
+        { "busy ms", "%.2f/%.2f", [](auto &w) { return w.busy * 1e3; } },
+        { "done wait ms",
+          "%.2f/%.2f",
+          [](auto &w) { return w.done_wait * 1e3; } },
+    };
+
+    fprintf(out,
+            "workers over the last %u frames, p50/p99:\n%6s",
+            unsigned(_window.size()),
+            "worker");
+    for (const Column &c : columns)
+        fprintf(out, " %14s", c.name);
+    fprintf(out, "\n");
+
+    const size_t nworkers = _window.back().workers.size();
+    std::vector<double> x;
+    for (size_t i = 0; i < nworkers; ++i) {
+        fprintf(out, "%6u", unsigned(i));
+        for (const Column &c : columns) {
+            x.clear();
+            for (const FrameStats &f : _window)
+                if (i < f.workers.size())
+                    x.push_back(c.value(f.workers[i]));
+            double p50 = percentile(x, 0.5);
+            double p99 = percentile(x, 0.99);
+            char cell[64];
+            snprintf(cell, sizeof cell, c.format, p50, p99);
+            fprintf(out, " %14s", cell);
+        }
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+// what one worker did in one frame
+struct WorkerFrameStats
+{
+    uint32_t tiles = 0;
+    uint32_t stolen = 0;
+    // steal attempts that found a deque empty or lost the race for it
+    uint32_t failed_steals = 0;
+    // seconds from the start of the frame until the worker woke up, from then
+    // until it ran out of tiles, and from then until the frame was done
+    double start_wait = 0;
+    double busy = 0;
+    double done_wait = 0;
+};
+
+struct FrameStats
+{
+    uint64_t id = 0;
+    double render_time = 0;
+    std::vector<WorkerFrameStats> workers;
+};
+
+// Keeps the statistics of the last frames for the percentiles shown on the
+// console and appends every frame to a CSV file if one is open, one row per
+// worker.
+class WorkerStatsLog
+{
+public:
+    explicit WorkerStatsLog(uint32_t window = 256) : _window_size(window) {}
+    ~WorkerStatsLog();
+
+    WorkerStatsLog(const WorkerStatsLog &) = delete;
+    WorkerStatsLog &operator=(const WorkerStatsLog &) = delete;
+
+    // false if path can not be opened
+    bool open_csv(const std::string &path);
+
+    void add(const FrameStats &frame);
+
+    // p50 and p99 of every statistic of every worker over the window
+    void print(FILE *out) const;
+
+    size_t frames() const { return _window.size(); }
+
+private:
+    const uint32_t _window_size;
+    std::deque<FrameStats> _window;
+    FILE *_csv = nullptr;
+};